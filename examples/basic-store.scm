@@ -102,8 +102,9 @@
 
 ; Obtain the DHT key-hash for this atom.  For this Atom in an AtomSpace
 ; with this particular name, this will be globally unique, and it
-; should be equal to 2220eca6560c36cde76315204130dbb182756a9b.
-; This 160-bit hash is derived from the Atom type and the Atom name.
+; should be equal to beead0296335897c6159d1f97882a3875e9989b4.
+; This 160-bit hash is derived from the Atom type, the Atom name and
+; the AtomSpace hash.
 (display (dht-atom-hash (ConceptNode "foo"))) (newline)
 
 ; The Values and Incoming Set attached to it can be examined:
@@ -153,9 +154,9 @@
 
 ; Notice that it had an entry labelled "Incoming".  It should have
 ; printed like so:
-;     Incoming: bc91a93a9a0d046e09cab9b9cea74a16f06c4675
+;     Incoming: b2340b6119de44804e04b211c29b399a65b7bd9c
 ; What is this mystery value?  Let's find out:
-(display (dht-examine "bc91a93a9a0d046e09cab9b9cea74a16f06c4675"))
+(display (dht-examine "b2340b6119de44804e04b211c29b399a65b7bd9c"))
 
 ; Oh. It was the (ListLink (ConceptNode "foo") (ConceptNode "bar"))
 ; That makes sense: "Incoming" is the incoming link (the ListLink).
@@ -165,9 +166,10 @@
 ; The immutable hash is different from the atom-hash:
 (dht-atom-hash (ListLink (ConceptNode "foo") (ConceptNode "bar")))
 
-; The immutable hash stores the globally-unique scheme string
-; representation of the Atom. This string representation is
-; independent of the AtomSpace; all AtomSpaces use the same string.
+; The immutable hash stores the globally-unique representation of the
+; Atom. It is computed from the Atom type, and either the Atom name
+; (for Nodes) or the immutable hashes of the outgoing set (for Links).
+; It is independent of the AtomSpace; all AtomSpaces use the same hash.
 ; The "mutable" hash is used to store the Values and IncomingSet of
 ; an Atom, as these exist in some particular AtomSpace.  The "mutable"
 ; hash thus incorporates the AtomSpace name; this allows different
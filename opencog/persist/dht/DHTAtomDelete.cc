@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <opendht/node.h>
 
+#include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atomspace/AtomSpace.h>
 #include <opencog/persist/sexpr/Sexpr.h>
@@ -31,8 +32,8 @@ void DHTAtomStorage::removeAtom(const Handle& atom, bool recursive)
 	barrier();
 
 	// First, check to see if there's an incoming set, or not.
-	dht::InfoHash mhash = get_membership(atom);
-	auto dinset = get_stuff(mhash, _incoming_filter);
+	dht::InfoHash mhash = read_membership(atom);
+	auto dinset = large_set_get(mhash);
 
 	// Fail if not recursive and have a non-trivial incoming set.
 	// Note that this is racey: the incoming set can change,
@@ -55,10 +56,11 @@ void DHTAtomStorage::removeAtom(const Handle& atom, bool recursive)
 	// it contains.
 	if (atom->is_link())
 	{
+		dht::InfoHash holderguid = get_guid(atom);
 		for (const Handle& held: atom->getOutgoingSet())
 		{
-			dht::InfoHash memuid = get_membership(held);
-			_runner.put(memuid,
+			dht::InfoHash memuid = read_membership(held);
+			large_set_remove(memuid, holderguid,
 				dht::Value(_incoming_policy, zerohash, atom->get_hash()));
 		}
 	}
@@ -69,25 +71,24 @@ void DHTAtomStorage::removeAtom(const Handle& atom, bool recursive)
 	// small chance that two different Atoms will collide. In this
 	// case, we want to broadcast the string, to disambiguate
 	// which one is to be removed.
-	std::string gstr = "drop " + std::to_string(now())
-		+ " " + Sexpr::encode_atom(atom);
-	_runner.put(_atomspace_hash,
-	            dht::Value(_space_policy, gstr, atom->get_hash()));
+	std::string gstr = space_record("drop", atom);
+	put_stuff(get_space_bucket(atom),
+	          dht::Value(_space_policy, gstr, atom->get_hash()));
+	put_stuff(get_type_bucket(atom),
+	          dht::Value(_space_policy, gstr, atom->get_hash()));
 
 	// Trash the values, too
 	delete_atom_values(atom);
 
 	// Update the index, so that if the Atom is recreated later,
 	// it appears to be brand-new.
-	{
-		std::unique_lock<std::mutex> lck(_publish_mutex);
-		_published.erase(atom);
-	}
+	_published.erase(atom);
 
 	// Drop the atom from out caches
+	_membership_map.erase(atom);
 	{
-		std::lock_guard<std::mutex> lck(_membership_mutex);
-		_membership_map.erase(atom);
+		std::lock_guard<std::mutex> lck(_legacy_mutex);
+		_legacy_muids.erase(atom);
 	}
 
 	// Bug with stats: should not increment on recursion.
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <msgpack.hpp>
+
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/atoms/base/Link.h>
@@ -36,16 +38,58 @@ Handle DHTAtomStorage::fetch_atom(const dht::InfoHash& guid)
 	// it be more space-efficient to never use this map, and to
 	// always got straight to the DHT library? How slow would
 	// that be? How much of a diffrence does it make?
-	std::unique_lock<std::mutex> lck(_decode_mutex);
-	const auto& da = _decode_map.find(guid);
-	if (_decode_map.end() != da) return da->second;
-	lck.unlock();
+	Handle h;
+	if (_decode_map.get(guid, h)) return h;
+
+	// Not found. Ask the DHT for it, and wait for the answer. We
+	// MUST get something back, before we return to the caller.
+	auto gvals = disk_get(guid);
+	if (gvals.empty())
+	{
+		gvals = get_stuff(guid, {}, ATOM_KEYS);
+		disk_put(guid, gvals);
+	}
+	return decode_guid(guid, gvals);
+}
 
-	// Not found. Ask the DHT for it. Get a future for the atom,
-	// and wait on it. We cannot do an async wait here; we MUST
-	// get something back, before we return to the caller.
-	auto gvals = get_stuff(guid);
+/**
+ * Same as above, except that it does not wait. The callback `cb` is
+ * called with the Atom, either immediately (if it is in one of the
+ * local caches), or later, on a dispatcher thread.
+ */
+void DHTAtomStorage::fetch_atom_async(const dht::InfoHash& guid,
+                              std::function<void(const Handle&)> cb,
+                              InFlight* ifl)
+{
+	Handle h;
+	if (_decode_map.get(guid, h))
+	{
+		cb(h);
+		return;
+	}
 
+	auto gvals = disk_get(guid);
+	if (not gvals.empty())
+	{
+		cb(decode_guid(guid, gvals));
+		return;
+	}
+
+	get_async(guid,
+		[this, guid, cb](ValueSeq&& gvals)
+		{
+			disk_put(guid, gvals);
+			cb(decode_guid(guid, gvals));
+		}, {}, ifl);
+}
+
+/**
+ * Decode the Atom that was found at the guid, and remember it in the
+ * local cache.
+ */
+Handle DHTAtomStorage::decode_guid(const dht::InfoHash& guid,
+                                   const ValueSeq& gvals)
+{
 	// Yikes! Fatal error! We're asked to process a GUID and we
 	// have no clue what Atom it corresponds to!
 	if (0 == gvals.size())
@@ -53,14 +97,66 @@ Handle DHTAtomStorage::fetch_atom(const dht::InfoHash& guid)
 
 	// There may be more than one value, but they should all be
 	// one and the same.
-	std::string satom = gvals[0]->unpack<std::string>();
-	Handle h(Sexpr::decode_atom(satom));
+	const dht::Blob& blob = gvals[0]->data;
+	msgpack::object_handle oh =
+		msgpack::unpack((const char*) blob.data(), blob.size());
+	const msgpack::object& obj = oh.get();
+
+	// Older records hold the s-expression for the whole Atom.
+	Handle h;
+	if (msgpack::type::STR == obj.type)
+		h = Sexpr::decode_atom(obj.as<std::string>());
+	else
+		h = decode_atom(obj);
 
-	lck.lock();
-	_decode_map.emplace(std::make_pair(guid, h));
+	_decode_map.put(guid, h);
 	return h;
 }
 
+/**
+ * Decode the binary Atom record created by encode_atom(). The Atoms
+ * in the outgoing set of a Link are given by their GUIDs; these are
+ * resolved with fetch_atom_async(), and thus, usually, from the local
+ * cache. Those that are not cached are all fetched at once. If `local`
+ * is given, then they are looked up there instead, and nothing is
+ * fetched.
+ */
+Handle DHTAtomStorage::decode_atom(const msgpack::object& obj,
+                                   const GuidMap* local)
+{
+	if (msgpack::type::ARRAY != obj.type or 3 != obj.via.array.size or
+	    ATOM_FORMAT != obj.via.array.ptr[0].as<int>())
+		throw RuntimeException(TRACE_INFO, "Unknown DHT atom format");
+
+	Type t = nameserver().getType(obj.via.array.ptr[1].as<std::string>());
+	const msgpack::object& body = obj.via.array.ptr[2];
+
+	if (nameserver().isA(t, NODE))
+		return createNode(t, body.as<std::string>());
+
+	HandleSeq oset(body.via.array.size);
+	if (local)
+	{
+		for (uint32_t i = 0; i < body.via.array.size; i++)
+		{
+			dht::InfoHash guid = body.via.array.ptr[i].as<dht::InfoHash>();
+			auto it = local->find(guid);
+			if (local->end() == it)
+				throw IOException(TRACE_INFO, "Outgoing Atom %s is missing",
+					guid.toString().c_str());
+			oset[i] = it->second;
+		}
+		return createLink(oset, t);
+	}
+
+	InFlight ifl;
+	for (uint32_t i = 0; i < body.via.array.size; i++)
+		fetch_atom_async(body.via.array.ptr[i].as<dht::InfoHash>(),
+			[&oset, i](const Handle& h) { oset[i] = h; }, &ifl);
+	inflight_drain(ifl);
+	return createLink(oset, t);
+}
+
 /* ================================================================ */
 
 Handle DHTAtomStorage::getNode(Type t, const char * str)
@@ -15,6 +15,7 @@
 
 #include <opendht/log.h>
 
+#include <opencog/util/Logger.h>
 #include <opencog/atomspace/AtomSpace.h>
 #include <opencog/atomspaceutils/TLB.h>
 
@@ -30,6 +31,58 @@ std::atomic<size_t> DHTAtomStorage::_value_stores = 0;
 std::atomic<size_t> DHTAtomStorage::_value_edits = 0;
 std::atomic<size_t> DHTAtomStorage::_incoming_stores = 0;
 std::atomic<size_t> DHTAtomStorage::_incoming_edits = 0;
+std::atomic<size_t> DHTAtomStorage::_incoming_dups = 0;
+
+/* ================================================================ */
+// Value types
+
+/**
+ * Return the DHT value type, with its storage policies, for the given
+ * type id. These are the same for every node holding AtomSpace data,
+ * including the seeder.
+ */
+dht::ValueType DHTAtomStorage::value_type(dht::ValueType::Id id)
+{
+	// For now, hardcode to one week. In fact, atoms should probably be
+	// permanent, and the rest should be configureable on a per-atomspace
+	// basis. Which means that we may need to adjust these dynamically...
+	std::chrono::hours lifetime(DATA_LIFETIME);
+
+	switch (id)
+	{
+		case ATOM_ID:
+			return dht::ValueType(ATOM_ID, "atom policy",
+				lifetime, cy_store_atom, cy_edit_atom);
+
+		case SPACE_ID:
+			return dht::ValueType(SPACE_ID, "space policy",
+				lifetime, cy_store_space, cy_edit_space);
+
+		case VALUES_ID:
+			return dht::ValueType(VALUES_ID, "values policy",
+				lifetime, cy_store_values, cy_edit_values);
+
+		case INCOMING_ID:
+			return dht::ValueType(INCOMING_ID, "incoming policy",
+				lifetime, cy_store_incoming, cy_edit_incoming);
+
+		// The split markers on large-set trie nodes. These are always
+		// identical, so the default policies are good enough.
+		case TRIE_ID:
+			return dht::ValueType(TRIE_ID, "trie policy", lifetime);
+
+		// The has-values summary segments. Updates are merged.
+		case BLOOM_ID:
+			return dht::ValueType(BLOOM_ID, "bloom policy", lifetime,
+				dht::ValueType::DEFAULT_STORE_POLICY, cy_edit_bloom);
+
+		// Snapshot chunks, manifests and announcements.
+		case SNAPSHOT_ID:
+			return dht::ValueType(SNAPSHOT_ID, "snapshot policy", lifetime,
+				dht::ValueType::DEFAULT_STORE_POLICY, cy_edit_snapshot);
+	}
+	throw RuntimeException(TRACE_INFO, "Unknown DHT value type %d", id);
+}
 
 /* ================================================================ */
 // Constructors
@@ -81,33 +134,58 @@ void DHTAtomStorage::init(const char * uri)
 
 	// --------------------------------------------------------------
 	// Network configuration
-	// How long to wait for an answer
+	// The longest that a single get is waited on; the actual timeouts
+	// adapt to the measured round-trip times. See get_stuff().
 	_wait_time = std::chrono::milliseconds(4000);
 
-	// Policies for storing atoms
+	// How many value-fetches to keep in flight, during bulk loads.
+#define DEFAULT_LOAD_WINDOW 256
+	_load_window = DEFAULT_LOAD_WINDOW;
 
-	// For now, hardcode to one week. In fact, atoms should probably be
-	// permanent, and the rest should be configureable on a per-atomspace
-	// basis. Which means that we may need to adjust these dynamically...
-#define DATA_LIFETIME 24*7
-	std::chrono::hours lifetime(DATA_LIFETIME);
+	// How many incoming-set holders to fetch at the same time.
+#define DEFAULT_INCOMING_WINDOW 64
+	_incoming_window = DEFAULT_INCOMING_WINDOW;
+
+	// How many threads to use for bulk stores.
+	_store_threads = std::thread::hardware_concurrency();
+	if (0 == _store_threads) _store_threads = 1;
 
-	_atom_policy = dht::ValueType(ATOM_ID, "atom policy",
-		lifetime, cy_store_atom, cy_edit_atom);
+	// How many puts to start out with, in flight, during bulk stores.
+	// This is adjusted up and down as the puts complete.
+#define INITIAL_PUT_WINDOW 64
+	_put_window = INITIAL_PUT_WINDOW;
+	_put_srtt = 0.0;
+	_put_min_rtt = 0.0;
+	_put_min_prev = 0.0;
+	_put_min_start = std::chrono::steady_clock::now();
 
-	_space_policy = dht::ValueType(SPACE_ID, "space policy",
-		lifetime, cy_store_space, cy_edit_space);
+	// Stores are done immediately, unless set_write_behind() is called.
+	_write_behind = false;
+	_writer_stop = true;
+	_writes_busy = 0;
 
-	_values_policy = dht::ValueType(VALUES_ID, "values policy",
-		lifetime, cy_store_values, cy_edit_values);
+	// Not known, until the marker is seen, or put.
+	_type_indexed = false;
 
-	_incoming_policy = dht::ValueType(INCOMING_ID, "incoming policy",
-		lifetime, cy_store_incoming, cy_edit_incoming);
+	// Policies for storing atoms
+	_atom_policy = value_type(ATOM_ID);
+	_space_policy = value_type(SPACE_ID);
+	_values_policy = value_type(VALUES_ID);
+	_incoming_policy = value_type(INCOMING_ID);
+	_trie_policy = value_type(TRIE_ID);
+	_bloom_policy = value_type(BLOOM_ID);
+	_snapshot_policy = value_type(SNAPSHOT_ID);
+	_bloom.resize(NUM_BLOOM_SEGMENTS);
 
 	// Use filters, because the same membership hash gets used
 	// for both values and for incoming sets.
+	_space_filter = dht::Value::TypeFilter(_space_policy);
 	_values_filter = dht::Value::TypeFilter(_values_policy);
 	_incoming_filter = dht::Value::TypeFilter(_incoming_policy);
+	_bloom_filter = dht::Value::TypeFilter(_bloom_policy);
+	_snapshot_filter = dht::Value::TypeFilter(_snapshot_policy);
+	_set_filter = [](const dht::Value& v)
+		{ return INCOMING_ID == v.type or TRIE_ID == v.type; };
 
 	// Run a private NetID only for AtomSpace data!
 	_config.dht_config.node_config.network = 42;
@@ -162,6 +240,11 @@ void DHTAtomStorage::init(const char * uri)
 	else
 		_runner.run(_port, _config);
 
+	// Our own entry in counters; see DHTCounter.cc. This depends on
+	// the port, and so can only be done after the node is running.
+	_counter_id = writer_id();
+	counter_restore();
+
 	// XXX for now, dump to a logfile. Disable this later.
 	dht::log::enableFileLogging(_runner, "atomspace-dht.log");
 
@@ -171,6 +254,18 @@ void DHTAtomStorage::init(const char * uri)
 	_runner.registerType(_space_policy);
 	_runner.registerType(_values_policy);
 	_runner.registerType(_incoming_policy);
+	_runner.registerType(_trie_policy);
+	_runner.registerType(_bloom_policy);
+	_runner.registerType(_snapshot_policy);
+
+	// Threads that handle the replies to asynchronous gets.
+#define DEFAULT_DISPATCH_THREADS 4
+	start_dispatch(DEFAULT_DISPATCH_THREADS);
+
+	// Thread that sends failed puts again.
+	_resend_stop = false;
+	_put_seq = 0;
+	_resender = std::thread(&DHTAtomStorage::resend_loop, this);
 
 	// Do NOT fiddle with atomspace contents, if nothing is open!
 	if (not _observing_only)
@@ -208,13 +303,72 @@ void DHTAtomStorage::dht_bootstrap(const std::string& uri)
 	_runner.bootstrap(hostname, std::to_string(port));
 }
 
-DHTAtomStorage::DHTAtomStorage(std::string uri)
+// The maximum number of entries in each of the local caches. Each
+// entry holds an Atom, and so this is also a cap on how many Atoms
+// are kept alive by the caches.
+#define DEFAULT_CACHE_CAPACITY (1<<20)
+
+// The number of large-set trie nodes tracked locally. Each holds the
+// ids of up to LARGE_SET_NODE_SIZE items.
+#define TRIE_CACHE_CAPACITY (1<<14)
+
+// The number of (Atom, key) counter states of other writers kept
+// locally. These are only used for showing the count; our own entries
+// are always kept.
+#define COUNTER_CACHE_CAPACITY (1<<16)
+
+// The number of Atoms for which the timestamp of the latest membership
+// record heard of is kept. A record for an Atom that was forgotten is
+// applied, whatever its age; the window for that is DATA_LIFETIME.
+#define LISTEN_STAMP_CAPACITY (1<<18)
+
+DHTAtomStorage::DHTAtomStorage(std::string uri) :
+	_guid_map(DEFAULT_CACHE_CAPACITY),
+	_decode_map(DEFAULT_CACHE_CAPACITY),
+	_membership_map(DEFAULT_CACHE_CAPACITY),
+	_published(DEFAULT_CACHE_CAPACITY),
+	_counters(COUNTER_CACHE_CAPACITY),
+	_remote_values(DEFAULT_CACHE_CAPACITY),
+	_listen_stamps(LISTEN_STAMP_CAPACITY),
+	_trie_nodes(TRIE_CACHE_CAPACITY)
 {
 	init(uri.c_str());
 }
 
 DHTAtomStorage::~DHTAtomStorage()
 {
+	// Write out anything that is still dirty.
+	try
+	{
+		set_write_behind(false);
+	}
+	catch (const std::exception& ex)
+	{
+		logger().warn("DHT write-behind store failed at close: %s",
+		              ex.what());
+	}
+
+	// Stop following other writers.
+	cancel_listens();
+
+	// Wait for all puts to be acknowledged, or given up on, and
+	// then stop the resender. Incoming-set updates that are waiting
+	// on a trie node still have puts to make.
+	try
+	{
+		inflight_wait(_migrations, 0);
+		inflight_wait(_trie_loads, 0);
+		inflight_wait(_puts, 0);
+	}
+	catch (const IOException& ex)
+	{
+		logger().warn("DHT puts still pending at close");
+	}
+	stop_resend();
+
+	// Stop handling replies; anything still pending is dropped.
+	stop_dispatch();
+
 	// Calling the loop manually causes pending message queues to drain.
 	// Once for the high-priority queue, and once for the regular queue,
 	_runner.loop();
@@ -270,6 +424,92 @@ double DHTAtomStorage::now(void)
 	return std::chrono::duration_cast<flt>(stamp.time_since_epoch()).count();
 }
 
+/**
+ * Set the number of value-fetch requests that are kept in flight
+ * at the same time, when bulk-loading Atoms.
+ */
+void DHTAtomStorage::set_load_window(size_t window)
+{
+	if (0 == window)
+		throw RuntimeException(TRACE_INFO, "Load window must be positive");
+	_load_window = window;
+}
+
+/**
+ * Set the number of incoming-set holders that are fetched at the
+ * same time, by getIncomingSet() and getIncomingByType().
+ */
+void DHTAtomStorage::set_incoming_window(size_t window)
+{
+	if (0 == window)
+		throw RuntimeException(TRACE_INFO, "Incoming window must be positive");
+	_incoming_window = window;
+}
+
+/**
+ * Set the number of worker threads used by storeAtomSpace().
+ * Defaults to the number of CPU cores.
+ */
+void DHTAtomStorage::set_store_threads(size_t nthreads)
+{
+	if (0 == nthreads)
+		throw RuntimeException(TRACE_INFO, "Store threads must be positive");
+	_store_threads = nthreads;
+}
+
+/**
+ * Use the file at `path` as a local disk cache of DHT records. The
+ * file is created, if it does not exist. This should be called right
+ * after opening, before any Atoms are stored or fetched.
+ */
+void DHTAtomStorage::open_disk_cache(const std::string& path)
+{
+	std::atomic_store(&_disk_cache, std::make_shared<DHTDiskCache>(path));
+}
+
+std::shared_ptr<DHTDiskCache> DHTAtomStorage::disk_cache(void)
+{
+	return std::atomic_load(&_disk_cache);
+}
+
+DHTAtomStorage::ValueSeq
+DHTAtomStorage::disk_get(const dht::InfoHash& key,
+                         const dht::Value::Filter& filter)
+{
+	auto disk = disk_cache();
+	if (nullptr == disk) return ValueSeq();
+	return disk->get(key, filter);
+}
+
+void DHTAtomStorage::disk_put(const dht::InfoHash& key,
+                              const ValueSeq& dvals)
+{
+	auto disk = disk_cache();
+	if (nullptr == disk) return;
+	for (const auto& dval : dvals)
+		disk->put(key, *dval);
+}
+
+/**
+ * Set the maximum number of entries in each of the local caches
+ * (the GUID, MUID, decode and published-Atom caches, and the cache
+ * of counter states).
+ */
+void DHTAtomStorage::set_cache_capacity(size_t capacity)
+{
+	if (0 == capacity)
+		throw RuntimeException(TRACE_INFO, "Cache capacity must be positive");
+
+	_guid_map.set_capacity(capacity);
+	_decode_map.set_capacity(capacity);
+	_membership_map.set_capacity(capacity);
+	_published.set_capacity(capacity);
+	_remote_values.set_capacity(capacity);
+
+	std::lock_guard<std::mutex> lck(_counter_mutex);
+	_counters.set_capacity(capacity);
+}
+
 /* ================================================================== */
 /**
  * Get the node status.
@@ -316,22 +556,10 @@ std::string DHTAtomStorage::dht_searches_log(void)
 
 /* ================================================================== */
 
-std::vector<std::shared_ptr<dht::Value>>
-DHTAtomStorage::get_stuff(const dht::InfoHash& ihash,
-                          const dht::Value::Filter& filter)
-{
-	auto ifut = _runner.get(ihash, filter);
-	std::future_status status = ifut.wait_for(_wait_time);
-	if (std::future_status::ready != status)
-		throw IOException(TRACE_INFO, "DHT is not responding!");
-
-	return ifut.get();
-}
-
-/* ================================================================== */
-
 /**
  * Get the values attached to a key, decode and pretty-print them.
+ * If the key is the AtomSpace hash, then the contents of all of the
+ * AtomSpace membership buckets are printed.
  */
 std::string DHTAtomStorage::dht_examine(const std::string& hash)
 {
@@ -339,7 +567,14 @@ std::string DHTAtomStorage::dht_examine(const std::string& hash)
 
 	clock_t begin = clock();
 	dht::InfoHash ihash(hash);
-	auto ivals = get_stuff(ihash);
+
+	// The AtomSpace membership is scattered over many buckets;
+	// gather them all up, so that the whole AtomSpace is shown.
+	std::vector<std::shared_ptr<dht::Value>> ivals;
+	if (not _observing_only and ihash == _atomspace_hash)
+		ivals = get_space(_atomspace_name);
+	else
+		ivals = get_stuff(ihash);
 
 	clock_t end = clock();
 	double elapsed = double(end-begin)/CLOCKS_PER_SEC;
@@ -361,20 +596,35 @@ std::string DHTAtomStorage::prt_dht_value(
 	{
 		case ATOM_ID:
 			ss << "Atom seq=" << std::to_string(ival->seq) << " "
-			   << ival->unpack<std::string>() << std::endl;
+			   << prt_atom(ival->data) << std::endl;
 			break;
 		case SPACE_ID:
 			ss << "Member id=" << std::hex << ival->id << " "
 			   << ival->unpack<std::string>() << std::endl;
 			break;
 		case VALUES_ID:
-			ss << "Value: "
-			   << ival->unpack<std::string>() << std::endl;
+			ss << "Value: " << prt_values(ival->data) << std::endl;
 			break;
 		case INCOMING_ID:
 			ss << "Incoming: "
 			   << ival->unpack<dht::InfoHash>().toString() << std::endl;
 			break;
+		case TRIE_ID:
+			ss << "Large-set node: "
+			   << ival->unpack<std::string>() << std::endl;
+			break;
+		case BLOOM_ID:
+		{
+			size_t nbits = 0;
+			for (uint8_t byte : ival->data)
+				for (; byte; byte &= byte-1) nbits++;
+			ss << "Has-values summary: " << nbits << " of "
+			   << 8 * ival->data.size() << " bits set" << std::endl;
+			break;
+		}
+		case SNAPSHOT_ID:
+			ss << "Snapshot data: " << ival->data.size() << " bytes" << std::endl;
+			break;
 		default:
 			ss << "Raw: " << ival->toString() << std::endl;
 			break;
@@ -382,6 +632,30 @@ std::string DHTAtomStorage::prt_dht_value(
 	return ss.str();
 }
 
+/// Print the binary Atom record, with the outgoing set shown as
+/// GUIDs (which can be passed to `dht-examine` in turn).
+std::string DHTAtomStorage::prt_atom(const dht::Blob& blob)
+{
+	msgpack::object_handle oh =
+		msgpack::unpack((const char*) blob.data(), blob.size());
+	const msgpack::object& obj = oh.get();
+
+	if (msgpack::type::STR == obj.type)
+		return obj.as<std::string>();
+
+	if (msgpack::type::ARRAY != obj.type or 3 != obj.via.array.size)
+		return "(malformed atom record)";
+
+	std::string str = "(" + obj.via.array.ptr[1].as<std::string>();
+	const msgpack::object& body = obj.via.array.ptr[2];
+	if (msgpack::type::STR == body.type)
+		return str + " \"" + body.as<std::string>() + "\")";
+
+	for (uint32_t i = 0; i < body.via.array.size; i++)
+		str += " " + body.via.array.ptr[i].as<dht::InfoHash>().toString();
+	return str + ")";
+}
+
 std::string DHTAtomStorage::dht_atomspace_hash(void)
 {
 	if (_atomspace_name.size() <= 1)
@@ -398,7 +672,7 @@ std::string DHTAtomStorage::dht_atom_hash(const Handle& atom)
 {
 	if (_atomspace_name.size() <= 1)
 		throw IOException(TRACE_INFO, "AtomSpace DHT has not been opened.\n");
-	return get_membership(atom).toString();
+	return read_membership(atom).toString();
 }
 
 /* ================================================================== */
@@ -409,6 +683,25 @@ std::string DHTAtomStorage::dht_atom_hash(const Handle& atom)
 ///
 void DHTAtomStorage::barrier()
 {
+	// Write out everything that is dirty. This comes first, as
+	// the writer may start more background work.
+	write_flush();
+
+	// Wait for the incoming-set updates that are waiting on a trie
+	// node, for the background checks of stale Values, and for the
+	// copies of format-0 Atoms; these issue puts, which must go out
+	// before the barrier.
+	inflight_wait(_migrations, 0);
+	inflight_wait(_trie_loads, 0);
+	verify_drain();
+
+	// Wait until every put has been acknowledged by the DHT, or
+	// given up on, after retrying.
+	inflight_wait(_puts, 0);
+
+	auto disk = disk_cache();
+	if (disk) disk->flush();
+
 	// Calling this twice seems to cause all queues to be drained:
 	// The first time, its the high-priority queue, and the second
 	// time, the regular queue.
@@ -462,10 +755,30 @@ void DHTAtomStorage::clear_stats(void)
 	_num_get_inlinks = 0;
 	_num_node_inserts = 0;
 	_num_link_inserts = 0;
+	_num_link_repeats = 0;
 	_num_atom_deletes = 0;
+	_num_migrations = 0;
 	_value_updates = 0;
 	_value_deletes = 0;
 	_value_fetches = 0;
+	_value_verifies = 0;
+	_value_skips = 0;
+	_num_puts = 0;
+	_num_put_fails = 0;
+	_num_put_retries = 0;
+	_num_put_lost = 0;
+	_num_put_superseded = 0;
+	_resend_max_depth = 0;
+	_wb_enqueued = 0;
+	_wb_coalesced = 0;
+	_wb_written = 0;
+	{
+		std::lock_guard<std::mutex> lck(_dirty_mutex);
+		_wb_max_depth = 0;
+	}
+	_listen_adds = 0;
+	_listen_drops = 0;
+	_listen_values = 0;
 
 	_immutable_stores = 0;
 	_immutable_edits = 0;
@@ -475,6 +788,29 @@ void DHTAtomStorage::clear_stats(void)
 	_value_edits = 0;
 	_incoming_stores = 0;
 	_incoming_edits = 0;
+	_incoming_dups = 0;
+	_counter_merges = 0;
+
+	{
+		// The round-trip estimates are kept; only the counts go.
+		std::lock_guard<std::mutex> lck(_rtt_mutex);
+		for (RttEstimator& est : _rtt)
+			est.hedges = est.hedge_wins = est.retries = est.timeouts = 0;
+	}
+
+	_guid_map.clear_stats();
+	_decode_map.clear_stats();
+	_membership_map.clear_stats();
+	_published.clear_stats();
+	_remote_values.clear_stats();
+}
+
+template<typename Cache>
+static void prt_cache(const char* name, const Cache& cache)
+{
+	printf("%s cache size = %zu of %zu hits = %zu misses = %zu evictions = %zu\n",
+	       name, cache.size(), cache.capacity(),
+	       cache.hits(), cache.misses(), cache.evictions());
 }
 
 void DHTAtomStorage::print_stats(void)
@@ -496,12 +832,93 @@ void DHTAtomStorage::print_stats(void)
 	size_t value_updates = _value_updates;
 	size_t value_deletes = _value_deletes;
 	size_t value_fetches = _value_fetches;
-	printf("dht-stats: value updates = %zu deletes = %zu fetches = %zu\n",
-	       value_updates, value_deletes, value_fetches);
+	size_t value_verifies = _value_verifies;
+	size_t value_skips = _value_skips;
+	printf("dht-stats: value updates = %zu deletes = %zu fetches = %zu verifies = %zu\n",
+	       value_updates, value_deletes, value_fetches, value_verifies);
+	printf("dht-stats: value fetches skipped (no values) = %zu\n",
+	       value_skips);
+
+	size_t num_puts = _num_puts;
+	size_t num_put_fails = _num_put_fails;
+	{
+		std::lock_guard<std::mutex> lck(_puts.mtx);
+		printf("dht-stats: puts = %zu failed = %zu in flight = %zu window = %d\n",
+		       num_puts, num_put_fails, _puts.busy, (int) _put_window);
+		printf("dht-stats: put latency avg = %f msecs min = %f msecs\n",
+		       _put_srtt, put_min_rtt());
+	}
+
+	size_t num_put_retries = _num_put_retries;
+	size_t num_put_lost = _num_put_lost;
+	size_t num_put_superseded = _num_put_superseded;
+	{
+		std::lock_guard<std::mutex> lck(_resend_mutex);
+		printf("dht-stats: put retries = %zu lost = %zu superseded = %zu\n",
+		       num_put_retries, num_put_lost, num_put_superseded);
+		printf("dht-stats: put resend queue = %zu max = %zu\n",
+		       _resend_queue.size(), _resend_max_depth);
+	}
+
+	if (_write_behind)
+	{
+		size_t wb_enqueued = _wb_enqueued;
+		size_t wb_coalesced = _wb_coalesced;
+		size_t wb_written = _wb_written;
+		size_t depth, max_depth;
+		{
+			std::lock_guard<std::mutex> lck(_dirty_mutex);
+			depth = _dirty_order.size();
+			max_depth = _wb_max_depth;
+		}
+		frac = wb_coalesced / ((double) (wb_enqueued + wb_coalesced));
+		printf("dht-stats: write-behind queue depth = %zu max = %zu\n",
+		       depth, max_depth);
+		printf("dht-stats: write-behind queued = %zu coalesced = %zu written = %zu coalesce ratio = %f\n",
+		       wb_enqueued, wb_coalesced, wb_written, frac);
+	}
+
+	for (int kc = 0; kc < NUM_KEY_CLASSES; kc++)
+	{
+		double rto, hedge;
+		rtt_timers((KeyClass) kc, rto, hedge);
+		std::lock_guard<std::mutex> lck(_rtt_mutex);
+		const RttEstimator& est = _rtt[kc];
+		if (0 == est.samples and 0 == est.timeouts) continue;
+		printf("dht-stats: get %-6s rtt = %f msecs var = %f rto = %f hedge after = %f\n",
+		       key_class_name((KeyClass) kc), est.srtt, est.rttvar, rto, hedge);
+		printf("dht-stats: get %-6s samples = %zu hedged = %zu hedge wins = %zu retries = %zu timeouts = %zu\n",
+		       key_class_name((KeyClass) kc), est.samples, est.hedges,
+		       est.hedge_wins, est.retries, est.timeouts);
+	}
 
 	size_t num_atom_deletes = _num_atom_deletes;
 	printf("dht-stats: total atom deletes = %zu\n",
 	       num_atom_deletes);
+
+	size_t num_migrations = _num_migrations;
+	size_t num_legacy;
+	{
+		std::lock_guard<std::mutex> lck(_legacy_mutex);
+		num_legacy = _legacy_muids.size();
+	}
+	if (num_migrations or num_legacy)
+		printf("dht-stats: format-0 atoms moved over = %zu still to move = %zu\n",
+		       num_migrations, num_legacy);
+
+	size_t num_listeners;
+	{
+		std::lock_guard<std::mutex> lck(_listen_mutex);
+		num_listeners = _listeners.size();
+	}
+	if (num_listeners)
+	{
+		size_t listen_adds = _listen_adds;
+		size_t listen_drops = _listen_drops;
+		size_t listen_values = _listen_values;
+		printf("dht-stats: listening on %zu keys; atoms added = %zu dropped = %zu value updates = %zu\n",
+		       num_listeners, listen_adds, listen_drops, listen_values);
+	}
 	printf("\n");
 
 	size_t num_get_atoms = _num_get_atoms;
@@ -524,6 +941,9 @@ void DHTAtomStorage::print_stats(void)
 	frac = tot_link / ((double) tot_node);
 	printf("total stores for node=%lu link=%lu ratio=%f\n",
 	       tot_node, tot_link, frac);
+	size_t num_link_repeats = _num_link_repeats;
+	printf("link re-stores (incoming set not re-sent) = %zu\n",
+	       num_link_repeats);
 
 	size_t immutable_stores = _immutable_stores;
 	size_t immutable_edits = _immutable_edits;
@@ -533,12 +953,44 @@ void DHTAtomStorage::print_stats(void)
 	size_t value_edits = _value_edits;
 	size_t incoming_stores = _incoming_stores;
 	size_t incoming_edits = _incoming_edits;
+	size_t incoming_dups = _incoming_dups;
 
 	printf("\n");
 	printf("dht immutable stores = %zu edits = %zu\n", immutable_stores, immutable_edits);
 	printf("dht space stores     = %zu edits = %zu\n", space_stores, space_edits);
 	printf("dht value stores     = %zu edits = %zu\n", value_stores, value_edits);
-	printf("dht incoming stores  = %zu edits = %zu\n", incoming_stores, incoming_edits);
+	printf("dht incoming stores  = %zu edits = %zu duplicates = %zu\n",
+	       incoming_stores, incoming_edits, incoming_dups);
+
+	size_t counter_merges = _counter_merges;
+	size_t num_counters, num_own;
+	{
+		std::lock_guard<std::mutex> lck(_counter_mutex);
+		num_counters = _counters.size();
+		num_own = _counter_own.size();
+	}
+	printf("dht counter merges   = %zu local counters = %zu own entries = %zu\n",
+	       counter_merges, num_counters, num_own);
+
+	auto disk = disk_cache();
+	if (disk)
+	{
+		printf("dht-stats: disk cache %s records = %zu\n",
+		       disk->path().c_str(), disk->size());
+		size_t disk_hits = disk->hits;
+		size_t disk_misses = disk->misses;
+		size_t disk_writes = disk->writes;
+		size_t disk_dups = disk->duplicates;
+		printf("dht-stats: disk cache hits = %zu misses = %zu writes = %zu duplicates = %zu\n",
+		       disk_hits, disk_misses, disk_writes, disk_dups);
+	}
+
+	printf("\n");
+	prt_cache("guid     ", _guid_map);
+	prt_cache("decode   ", _decode_map);
+	prt_cache("muid     ", _membership_map);
+	prt_cache("published", _published);
+	prt_cache("values   ", _remote_values);
 
 	printf("\n");
 }
@@ -16,9 +16,16 @@
 #define _OPENCOG_DHT_ATOM_STORAGE_H
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
 #include <mutex>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include <opendht.h>
@@ -34,6 +41,10 @@
 
 #include <opencog/atomspace/AtomTable.h>
 #include <opencog/atomspace/BackingStore.h>
+#include <opencog/util/concurrent_queue.h>
+
+#include <opencog/persist/dht/DHTDiskCache.h>
+#include <opencog/persist/dht/LRUCache.h>
 
 namespace opencog
 {
@@ -41,6 +52,18 @@ namespace opencog
  *  @{
  */
 
+/// The DHT keys are already cryptographic hashes; any 64 bits of
+/// them make a perfectly good hash-table hash.
+struct InfoHashHash
+{
+	size_t operator()(const dht::InfoHash& ih) const
+	{
+		size_t h;
+		memcpy(&h, ih.data(), sizeof(h));
+		return h;
+	}
+};
+
 class DHTAtomStorage : public BackingStore
 {
 	private:
@@ -62,16 +85,16 @@ class DHTAtomStorage : public BackingStore
 		dht::ValueType _space_policy;
 		dht::ValueType _values_policy;
 		dht::ValueType _incoming_policy;
+		dht::ValueType _trie_policy;
+		dht::ValueType _bloom_policy;
+		dht::ValueType _snapshot_policy;
 
+		dht::Value::Filter _space_filter;
 		dht::Value::Filter _values_filter;
 		dht::Value::Filter _incoming_filter;
-		enum
-		{
-			ATOM_ID = 4097,
-			SPACE_ID = 4098,
-			VALUES_ID = 4099,
-			INCOMING_ID = 4100,
-		};
+		dht::Value::Filter _set_filter;
+		dht::Value::Filter _bloom_filter;
+		dht::Value::Filter _snapshot_filter;
 		static bool cy_store_atom(dht::InfoHash key,
 		                std::shared_ptr<dht::Value>& value,
 		                const dht::InfoHash& from,
@@ -105,6 +128,18 @@ class DHTAtomStorage : public BackingStore
 		               const dht::InfoHash& from,
 		               const dht::SockAddr& addr);
 
+		static bool cy_edit_bloom(dht::InfoHash key,
+		               const std::shared_ptr<dht::Value>& old_val,
+		               std::shared_ptr<dht::Value>& new_val,
+		               const dht::InfoHash& from,
+		               const dht::SockAddr& addr);
+
+		static bool cy_edit_snapshot(dht::InfoHash key,
+		               const std::shared_ptr<dht::Value>& old_val,
+		               std::shared_ptr<dht::Value>& new_val,
+		               const dht::InfoHash& from,
+		               const dht::SockAddr& addr);
+
 		static bool cy_store_incoming(dht::InfoHash key,
 		                std::shared_ptr<dht::Value>& value,
 		                const dht::InfoHash& from,
@@ -117,31 +152,173 @@ class DHTAtomStorage : public BackingStore
 		               const dht::SockAddr& addr);
 
 		static std::string prt_dht_value(const std::shared_ptr<dht::Value>&);
+		static std::string prt_atom(const dht::Blob&);
 		double now(void);
 		// --------------------------
 		// Fetch and storing of atoms
+		// The local caches are bounded in size, and are thread-safe;
+		// they are lock-striped, so that threads rarely contend.
 
-		std::mutex _guid_mutex;
-		std::unordered_map<Handle, dht::InfoHash> _guid_map;
+		StripedCache<Handle, dht::InfoHash> _guid_map;
 		dht::InfoHash get_guid(const Handle&);
 
+		// Version of the GUID/MUID hashing scheme. Version 0 is the
+		// original SHA-1 of the scheme string; the membership records
+		// carry the version, so that older data remains readable.
+		enum { GUID_FORMAT = 1 };
+		dht::InfoHash legacy_membership(const Handle&);
+
+		// Atoms seen in format-0 membership records, and not yet moved
+		// over to the current format; their Values and incoming sets
+		// are still under the older MUID. This is never evicted:
+		// losing an entry would lose the Atom's Values. It shrinks as
+		// the Atoms are stored, and thus moved over.
+		std::mutex _legacy_mutex;
+		std::unordered_map<Handle, dht::InfoHash> _legacy_muids;
+		dht::InfoHash read_membership(const Handle&);
+		bool is_legacy(const Handle&);
+		void migrate_legacy(const Handle&, bool);
+
+		// Binary format of the immutable Atom records.
+		enum { ATOM_FORMAT = 1 };
+		dht::Blob encode_atom(const Handle&);
+		using GuidMap = std::unordered_map<dht::InfoHash, Handle, InfoHashHash>;
+		Handle decode_atom(const msgpack::object&, const GuidMap* = nullptr);
+
 		Handle fetch_atom(const dht::InfoHash&);
-		std::mutex _decode_mutex;
-		std::map<dht::InfoHash, Handle> _decode_map;
+		Handle decode_guid(const dht::InfoHash&,
+		                   const std::vector<std::shared_ptr<dht::Value>>&);
+		StripedCache<dht::InfoHash, Handle, InfoHashHash> _decode_map;
 
-		std::mutex _membership_mutex;
-		std::unordered_map<Handle, dht::InfoHash> _membership_map;
+		StripedCache<Handle, dht::InfoHash> _membership_map;
 		dht::InfoHash get_membership(const Handle&);
 
-		std::mutex _publish_mutex;
-		std::unordered_set<Handle> _published;
-		void publish_to_atomspace(const Handle&);
+		StripedCache<Handle, bool> _published;
+		bool publish_to_atomspace(const Handle&);
 		void store_recursive(const Handle&);
 
+		// --------------------------
+		// AtomSpace membership. The member Atoms are scattered over
+		// a fixed number of bucket keys, instead of being piled onto
+		// a single DHT key.
+		enum { NUM_SPACE_BUCKETS = 256 };
+		enum { NUM_TYPE_BUCKETS = 16 };
+		static dht::InfoHash space_key(const std::string&, const std::string&);
+		dht::InfoHash get_bucket(const std::string&, size_t);
+		dht::InfoHash get_space_bucket(const Handle&);
+		dht::InfoHash get_type_index(const std::string&, Type, size_t);
+		dht::InfoHash get_type_bucket(const Handle&);
+		std::atomic<bool> _type_indexed;
+		bool has_type_index(void);
+		std::vector<std::shared_ptr<dht::Value>>
+		get_keys(const std::vector<dht::InfoHash>&);
+		std::vector<std::shared_ptr<dht::Value>>
+		get_space(const std::string&);
+
+	public:
+		// A decoded membership record: "add <time> v<fmt> <sexpr>".
+		// The seeder needs these, too.
+		struct SpaceRecord
+		{
+			bool add;         // true for "add", false for "drop"
+			double stamp;     // time of the add or drop
+			int format;       // GUID_FORMAT of the writer
+			size_t pos;       // start of the s-expression
+		};
+		static bool parse_space_record(const std::string&, SpaceRecord&);
+
+	private:
+		std::string space_record(const char*, const Handle&);
+		Handle decode_space_record(const std::string&, const SpaceRecord&);
+
+		// The membership records already applied, per AtomSpace name:
+		// the timestamp of the latest record, per Atom (by dht-id). An
+		// incremental load only applies records not seen before. The
+		// writers' clocks are never compared to one-another.
+		std::mutex _mark_mutex;
+		std::map<std::string, std::unordered_map<dht::Value::Id, double>>
+			_space_seen;
+
+		// --------------------------
+		// Counters, kept as PN-counters; see DHTCounter.cc. The state
+		// last seen is kept for each (Atom, key) pair, by GUID, for
+		// the most recently used pairs only. Our own entries are kept
+		// for all pairs, and journaled to a file.
+		using CounterState = std::map<dht::InfoHash,
+		      std::pair<std::vector<double>, std::vector<double>>>;
+		using CounterKey = std::pair<dht::InfoHash, dht::InfoHash>;
+		struct CounterKeyHash
+		{
+			size_t operator()(const CounterKey& ck) const
+			{
+				return InfoHashHash()(ck.first) ^ InfoHashHash()(ck.second);
+			}
+		};
+		struct CounterOwn
+		{
+			std::vector<double> p;
+			std::vector<double> n;
+			std::vector<double> base; // local count, as last stored or fetched
+			bool live = true;
+		};
+		dht::InfoHash _counter_id;
+		dht::InfoHash writer_id(void);
+		std::string counter_path(const std::string&);
+		std::mutex _counter_mutex;
+		UnorderedHandleSet _counter_keys;
+		LRUCache<CounterKey, CounterState, CounterKeyHash> _counters;
+		std::unordered_map<CounterKey, CounterOwn, CounterKeyHash> _counter_own;
+		std::ofstream _counter_log;
+		void counter_restore(void);
+		void counter_journal(const CounterKey&, const CounterOwn&);
+		bool is_counter_key(const Handle&);
+		static bool is_countable(const ValuePtr&);
+		CounterState count_local(const Handle&, const Handle&, const ValuePtr&);
+		ValuePtr count_remote(const Handle&, const Handle&, const ValuePtr&,
+		                      const CounterState&);
+		using CounterTombs = std::vector<std::pair<Handle, CounterState>>;
+		CounterTombs counter_tombstones(const Handle&);
+		static void pack_counter(msgpack::packer<msgpack::sbuffer>&,
+		                         const CounterState&);
+		static CounterState unpack_counter(const msgpack::object&);
+		static void merge_counter(CounterState&, const CounterState&);
+		static std::vector<double> counter_total(const CounterState&);
+
 		// --------------------------
 		// Values
 		void store_atom_values(const Handle &);
 		Handle fetch_values(Handle&&);
+		void decode_values(Handle&,
+		                   const std::vector<std::shared_ptr<dht::Value>>&);
+		dht::Blob encode_values(const Handle&, const CounterTombs& = {});
+		void decode_values(Handle&, const dht::Blob&);
+		static bool has_values(const dht::Blob&);
+		static std::string prt_values(const dht::Blob&);
+
+		// What is known about the Values held in the DHT: true if the
+		// DHT holds Values for the Atom, false if it holds none. The
+		// state of Atoms not in the cache is unknown. Other writers
+		// may change it, and so what is known goes stale, after a while.
+		struct RemoteValues
+		{
+			bool held;
+			std::chrono::steady_clock::time_point seen;
+		};
+		StripedCache<Handle, RemoteValues> _remote_values;
+		bool remote_values_get(const Handle&, bool&);
+		void remote_values_put(const Handle&, bool);
+
+		// Held while the Values of an Atom are put or deleted, so that
+		// a background check cannot delete Values stored while it was
+		// waiting for its answer. Atoms share the locks, by hash.
+		enum { NUM_VALUES_LOCKS = 64 };
+		std::mutex _values_locks[NUM_VALUES_LOCKS];
+		std::mutex& values_lock(const Handle&);
+
+		// Bulk fetch of values, with many requests in flight.
+		size_t _load_window;
+		void fetch_values_pipelined(HandleSeq&&,
+		                  const std::function<void(const Handle&)>&);
 		void delete_atom_values(const Handle&);
 
 		// --------------------------
@@ -149,8 +326,320 @@ class DHTAtomStorage : public BackingStore
 		using Timeout = std::chrono::milliseconds;
 		Timeout _wait_time;
 
+		// Round-trip times differ a lot between kinds of keys (a large
+		// set lives on many nodes; an Atom on a few), and so they are
+		// estimated separately for each kind.
+		enum KeyClass
+		{
+			ATOM_KEYS,
+			VALUE_KEYS,
+			SET_KEYS,
+			SPACE_KEYS,
+			OTHER_KEYS,
+			NUM_KEY_CLASSES
+		};
+		static const char* key_class_name(KeyClass);
+
+		// Round-trip estimator for one class of keys, in msecs. The
+		// timeout is computed as in TCP (RFC 6298). Recent samples are
+		// kept, to find the delay after which a get is hedged. A timeout
+		// that was backed off is kept until the next fresh sample.
+		struct RttEstimator
+		{
+			double srtt = 0.0;
+			double rttvar = 0.0;
+			double backoff = 0.0;
+			size_t samples = 0;
+			std::vector<double> recent;
+			size_t hedges = 0;
+			size_t hedge_wins = 0;
+			size_t retries = 0;
+			size_t timeouts = 0;
+		};
+		std::mutex _rtt_mutex;
+		RttEstimator _rtt[NUM_KEY_CLASSES];
+		void rtt_sample(KeyClass, double);
+		void rtt_timers(KeyClass, double&, double&);
+		void rtt_backoff(KeyClass, double);
+
+		// All of the gets issued for one get_stuff() call. Each get
+		// gathers its own values; the first one to finish successfully
+		// wins. The others are left to run to completion; their results
+		// are dropped. A get that failed may have found only some of
+		// the values, and so never wins.
+		struct GetCall
+		{
+			std::mutex mtx;
+			std::condition_variable cv;
+			std::vector<std::vector<std::shared_ptr<dht::Value>>> vals;
+			int winner = -1;
+			size_t failed = 0;
+			std::chrono::steady_clock::time_point start =
+				std::chrono::steady_clock::now();
+		};
+		void issue_get(const std::shared_ptr<GetCall>&, const dht::InfoHash&,
+		               const dht::Value::Filter&, KeyClass);
 		std::vector<std::shared_ptr<dht::Value>>
-		get_stuff(const dht::InfoHash&, const dht::Value::Filter& = {});
+		get_wait(const std::shared_ptr<GetCall>&, const dht::InfoHash&,
+		         const dht::Value::Filter&, KeyClass);
+
+		std::vector<std::shared_ptr<dht::Value>>
+		get_stuff(const dht::InfoHash&, const dht::Value::Filter& = {},
+		          KeyClass = OTHER_KEYS);
+
+		// --------------------------
+		// Asynchronous gets. The DHT runner thread only collects the
+		// replies; the reply handlers are run on a pool of dispatcher
+		// threads. Thus, a handler is free to issue more gets, or to
+		// block, without stalling the DHT itself.
+		using ValueSeq = std::vector<std::shared_ptr<dht::Value>>;
+		using GetReply = std::function<void(ValueSeq&&)>;
+
+		// Bookkeeping for a batch of asynchronous requests: counts the
+		// number of requests still in flight, and holds the first
+		// error thrown by any of the reply handlers.
+		//
+		// The requests hold on to the `Ref`, and not to the InFlight
+		// itself; a waiter that gave up can thus go away before the
+		// requests finish. Reply handlers that have not started by
+		// then are skipped; the InFlight waits for those that have,
+		// as they may be using the waiter's data.
+		struct InFlight
+		{
+			std::mutex mtx;
+			std::condition_variable cv;
+			size_t busy = 0;
+			size_t done = 0;
+			std::exception_ptr error;
+
+			struct Ref
+			{
+				std::mutex mtx;
+				std::condition_variable cv;
+				InFlight* ifl;
+				size_t running = 0;
+			};
+			std::shared_ptr<Ref> ref;
+
+			InFlight() : ref(std::make_shared<Ref>()) { ref->ifl = this; }
+			~InFlight()
+			{
+				std::unique_lock<std::mutex> lck(ref->mtx);
+				ref->ifl = nullptr;
+				ref->cv.wait(lck, [this]{ return 0 == ref->running; });
+			}
+		};
+
+		void get_async(const dht::InfoHash&, GetReply,
+		               const dht::Value::Filter& = {}, InFlight* = nullptr,
+		               std::function<void(void)> = nullptr);
+		static bool inflight_enter(const std::shared_ptr<InFlight::Ref>&);
+		static void inflight_done(const std::shared_ptr<InFlight::Ref>&,
+		                          std::exception_ptr, bool = false);
+		void inflight_wait(InFlight&, size_t);
+		void inflight_drain(InFlight&);
+
+		// Optional local disk cache. Everything that is put, and
+		// all Atoms and Values that are fetched, are written through
+		// to it. Atoms are looked for there first, as their records
+		// never change; Values do, and so their copy on disk is used
+		// only when the DHT does not answer. The cache may be opened
+		// while others are using it; it is only ever accessed with
+		// atomic loads and stores of the pointer.
+		std::shared_ptr<DHTDiskCache> _disk_cache;
+		std::shared_ptr<DHTDiskCache> disk_cache(void);
+		ValueSeq disk_get(const dht::InfoHash&, const dht::Value::Filter& = {});
+		void disk_put(const dht::InfoHash&, const ValueSeq&);
+
+		// Flow control for puts. All puts are counted as in flight,
+		// until the DHT reports them done; bulk stores wait for the
+		// number in flight to drop below `_put_window`. The window
+		// is adjusted by additive-increase, multiplicative-decrease.
+		InFlight _puts;
+		double _put_window;
+		double _put_srtt;     // smoothed put completion time, msecs
+		double _put_min_rtt;  // fastest put in this min window, msecs
+		double _put_min_prev; // fastest put in the previous window
+		std::chrono::steady_clock::time_point _put_min_start;
+		double put_min_rtt(void);
+		std::chrono::steady_clock::time_point _put_last_cut;
+		void put_stuff(const dht::InfoHash&, dht::Value&&);
+		void put_throttle(size_t = 0);
+
+		// Puts that fail are sent again, after a backoff. A put stays
+		// in flight until it succeeds, or is given up on; barrier()
+		// waits for all of them. A put replaces the value with the
+		// same id on the key (its "slot"); a failed put is not sent
+		// again, once a later put to the same slot has been issued.
+		struct PendingPut
+		{
+			dht::InfoHash key;
+			std::shared_ptr<dht::Value> val;
+			int tries;
+			uint64_t seq;
+		};
+		using PutSlot = std::pair<dht::InfoHash, dht::Value::Id>;
+		struct PutSlotHash
+		{
+			size_t operator()(const PutSlot& ps) const
+			{
+				return InfoHashHash()(ps.first) ^ std::hash<uint64_t>()(ps.second);
+			}
+		};
+		using ResendQueue =
+			std::multimap<std::chrono::steady_clock::time_point, PendingPut>;
+		std::mutex _resend_mutex;
+		std::condition_variable _resend_cv;
+		ResendQueue _resend_queue;
+		bool _resend_stop;
+		std::thread _resender;
+
+		// The latest put issued to each slot, while it is in flight, and
+		// the waiting resend of each slot, if any. Guarded by _resend_mutex.
+		uint64_t _put_seq;
+		std::unordered_map<PutSlot, uint64_t, PutSlotHash> _put_latest;
+		std::unordered_map<PutSlot, ResendQueue::iterator, PutSlotHash>
+			_resend_slots;
+		void put_latest(PendingPut&);
+		void put_retire(const PendingPut&);
+		void send_put(PendingPut&&);
+		void put_done(bool, std::chrono::steady_clock::duration, PendingPut&&);
+		void put_finished(void);
+		void resend_loop(void);
+		void stop_resend(void);
+
+		// --------------------------
+		// Snapshots of the whole AtomSpace, in a single file.
+		static dht::InfoHash snapshot_key(const std::string&);
+		void export_atom(std::ofstream&, const Handle&, UnorderedHandleSet&);
+
+		// --------------------------
+		// Subscriptions to changes made by other DHT nodes.
+		// The latest membership record applied, per Atom (by dht-id);
+		// records that arrive out of order are not applied. Only the
+		// most recently changed Atoms are remembered.
+		std::mutex _listen_mutex;
+		std::vector<std::pair<dht::InfoHash, std::shared_future<size_t>>> _listeners;
+		LRUCache<dht::Value::Id, double> _listen_stamps;
+		bool listen_key(const dht::InfoHash&, const dht::Value::Filter&, GetReply);
+		void apply_space_record(AtomSpace*, dht::Value::Id, const std::string&);
+		bool listen_current(dht::Value::Id, double);
+		bool drop_local(AtomSpace*, const Handle&);
+		void cancel_listens(void);
+
+		concurrent_queue<std::function<void(void)>> _dispatch_queue;
+		std::vector<std::thread> _dispatchers;
+		bool dispatch(std::function<void(void)>&&);
+		void dispatch_loop(void);
+		void start_dispatch(size_t);
+		void stop_dispatch(void);
+
+		void fetch_atom_async(const dht::InfoHash&,
+		                      std::function<void(const Handle&)>,
+		                      InFlight*);
+		void fetch_values_async(const Handle&,
+		                        std::function<void(const Handle&)>,
+		                        InFlight*);
+
+		// Background check for stale Values on Atoms that have no keys.
+		// The Atoms to check wait in `_verify_queue`, until there is
+		// room in the load window; at most MAX_VERIFY_QUEUE of them.
+		InFlight _verify_values;
+		std::mutex _verify_mutex;
+		std::deque<Handle> _verify_queue;
+		void verify_values_async(const Handle&);
+		void verify_next(size_t);
+		void verify_drain(void);
+
+		// Background copies of the data of format-0 Atoms.
+		InFlight _migrations;
+
+		// --------------------------
+		// Large sets. OpenDHT limits the number of values, and the
+		// number of bytes, on a single key. Sets larger than this are
+		// kept in a hash-trie of DHT keys. Each trie node holds at most
+		// LARGE_SET_NODE_SIZE items; once it is full, it is marked as
+		// split, and further items go into one of its 16 children,
+		// chosen by the next nibble of the item hash.
+		enum { LARGE_SET_NODE_SIZE = 256 };
+		struct TrieNode
+		{
+			bool split = false;
+			std::set<dht::Value::Id> ids;
+		};
+		std::mutex _trie_mutex;
+		LRUCache<dht::InfoHash, TrieNode, InfoHashHash> _trie_nodes;
+		dht::InfoHash trie_key(const dht::InfoHash&, const std::string&);
+
+		// Trie nodes that are not known locally are fetched without
+		// waiting; the inserts and removals that need them wait in
+		// `_trie_waiting`, and are finished when the node arrives.
+		using TrieWork = std::function<void(void)>;
+		std::map<dht::InfoHash, std::vector<TrieWork>> _trie_waiting;
+		InFlight _trie_loads;
+		void with_trie_node(const dht::InfoHash&, TrieWork&&);
+		void trie_node_loaded(const dht::InfoHash&, bool, const ValueSeq&);
+		void trie_insert(const dht::InfoHash&, const dht::InfoHash&,
+		                 const std::shared_ptr<dht::Value>&, const std::string&);
+		void trie_remove(const dht::InfoHash&, const dht::InfoHash&,
+		                 const std::shared_ptr<dht::Value>&, const std::string&);
+
+		void large_set_insert(const dht::InfoHash&, const dht::InfoHash&,
+		                      dht::Value&&);
+		void large_set_remove(const dht::InfoHash&, const dht::InfoHash&,
+		                      dht::Value&&);
+		void large_set_walk(const dht::InfoHash&, const std::string&,
+		                    const GetReply&, InFlight*);
+		ValueSeq large_set_get(const dht::InfoHash&);
+
+		// Number of worker threads for storeAtomSpace()
+		size_t _store_threads;
+
+		// Summary of which Atoms have Values: a Bloom filter of their
+		// MUIDs, split into segments, one per DHT key.
+		struct BloomSegment
+		{
+			bool fetched = false;   // got it from the DHT at `when`
+			bool complete = false;  // the DHT had a completeness marker
+			time_t when = 0;
+			dht::Blob bits;
+			std::vector<std::function<void(bool)>> waiting;
+		};
+		std::mutex _bloom_mutex;
+		std::vector<BloomSegment> _bloom;
+		dht::InfoHash bloom_key(const std::string&, size_t);
+		void bloom_add(const dht::InfoHash&);
+		bool bloom_may_have(const dht::InfoHash&);
+		void bloom_may_have_async(const dht::InfoHash&,
+		                          std::function<void(bool)>);
+		bool bloom_test(const dht::InfoHash&);
+		void bloom_when_fresh(size_t, std::function<void(bool)>&&);
+		void bloom_loaded(size_t, bool, const ValueSeq&, time_t);
+		void bloom_update(size_t, const ValueSeq&, time_t);
+		void bloom_complete(const std::vector<dht::InfoHash>&);
+		void bloom_prefetch(void);
+
+		// Incoming sets, fetched with many requests in flight.
+		size_t _incoming_window;
+		void fetch_incoming(AtomTable&, const Handle&, Type);
+
+		// --------------------------
+		// Write-behind. When enabled, storeAtom() only marks the Atom
+		// as dirty; a writer thread does the actual store. Repeated
+		// stores of an Atom that is still dirty are coalesced. The
+		// first store that failed is reported by the next barrier().
+		std::atomic<bool> _write_behind;
+		bool _writer_stop;
+		size_t _writes_busy;
+		std::exception_ptr _write_error;
+		std::mutex _dirty_mutex;
+		std::condition_variable _dirty_cv;
+		std::deque<Handle> _dirty_order;
+		UnorderedHandleSet _dirty;
+		std::thread _writer;
+		void write_behind(const Handle&);
+		void write_loop(void);
+		void write_flush(void);
 
 		// --------------------------
 		// Performance statistics
@@ -161,12 +650,29 @@ class DHTAtomStorage : public BackingStore
 		std::atomic<size_t> _num_get_inlinks;
 		std::atomic<size_t> _num_node_inserts;
 		std::atomic<size_t> _num_link_inserts;
+		std::atomic<size_t> _num_link_repeats;
 		std::atomic<size_t> _num_atom_deletes;
+		std::atomic<size_t> _num_migrations;
 		std::atomic<size_t> _load_count;
 		std::atomic<size_t> _store_count;
 		std::atomic<size_t> _value_updates;
 		std::atomic<size_t> _value_deletes;
 		std::atomic<size_t> _value_fetches;
+		std::atomic<size_t> _value_verifies;
+		std::atomic<size_t> _value_skips;
+		std::atomic<size_t> _num_puts;
+		std::atomic<size_t> _num_put_fails;
+		std::atomic<size_t> _num_put_retries;
+		std::atomic<size_t> _num_put_lost;
+		std::atomic<size_t> _num_put_superseded;
+		size_t _resend_max_depth;
+		std::atomic<size_t> _wb_enqueued;
+		std::atomic<size_t> _wb_coalesced;
+		std::atomic<size_t> _wb_written;
+		size_t _wb_max_depth;  // guarded by _dirty_mutex
+		std::atomic<size_t> _listen_adds;
+		std::atomic<size_t> _listen_drops;
+		std::atomic<size_t> _listen_values;
 
 		// These have to be static, as they are incremented
 		// from static functions.
@@ -178,9 +684,41 @@ class DHTAtomStorage : public BackingStore
 		static std::atomic<size_t> _value_edits;
 		static std::atomic<size_t> _incoming_stores;
 		static std::atomic<size_t> _incoming_edits;
+		static std::atomic<size_t> _incoming_dups;
+		static std::atomic<size_t> _counter_merges;
 		time_t _stats_time;
 
 	public:
+		// The DHT value types for AtomSpace data.
+		enum
+		{
+			ATOM_ID = 4097,
+			SPACE_ID = 4098,
+			VALUES_ID = 4099,
+			INCOMING_ID = 4100,
+			TRIE_ID = 4101,
+			BLOOM_ID = 4102,
+			SNAPSHOT_ID = 4103,
+		};
+		static dht::ValueType value_type(dht::ValueType::Id);
+
+		// Merge the counter states of an older Values record into a
+		// newer one; see DHTCounter.cc.
+		static bool merge_counters(const dht::Blob&, dht::Blob&);
+
+		// How long the DHT keeps AtomSpace data, in hours.
+		enum { DATA_LIFETIME = 24*7 };
+
+		// Sizes of the has-values summary. They are part of the DHT
+		// data format; changing them makes older summaries unusable.
+		enum
+		{
+			NUM_BLOOM_SEGMENTS = 256,
+			BLOOM_SEGMENT_BYTES = 1024,
+			BLOOM_HASHES = 4,
+			BLOOM_FORMAT = 1,
+		};
+
 		DHTAtomStorage(std::string uri);
 		DHTAtomStorage(const DHTAtomStorage&) = delete; // disable copying
 		DHTAtomStorage& operator=(const DHTAtomStorage&) = delete; // disable assignment
@@ -197,7 +735,24 @@ class DHTAtomStorage : public BackingStore
 		std::string dht_routing_tables_log(void);
 		std::string dht_searches_log(void);
 
-		void load_atomspace(AtomSpace*, const std::string&);
+		void load_atomspace(AtomSpace*, const std::string&,
+		                    bool incremental = false);
+		void set_load_window(size_t);
+		void set_incoming_window(size_t);
+		void set_cache_capacity(size_t);
+		void set_write_behind(bool);
+		void set_store_threads(size_t);
+		void open_disk_cache(const std::string&);
+
+		void export_snapshot(AtomSpace*, const std::string&);
+		void import_snapshot(AtomSpace*, const std::string&);
+		std::string publish_snapshot(const std::string&);
+		std::string latest_snapshot(void);
+		void fetch_snapshot(const std::string&, const std::string&);
+
+		void listen_atomspace(AtomSpace*);
+		void listen_values(AtomSpace*, const Handle&);
+		void add_counter_key(const Handle&);
 
 		void kill_data(void); // destroy DB contents
 
@@ -7,8 +7,10 @@
  */
 
 #include <stdlib.h>
+#include <msgpack.hpp>
 #include <opendht/node.h>
 
+#include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atomspace/AtomSpace.h>
 #include <opencog/persist/sexpr/Sexpr.h>
@@ -34,6 +36,8 @@ void DHTAtomStorage::store_recursive(const Handle& h)
 	if (_observing_only)
 		throw IOException(TRACE_INFO, "DHT Node is only observing!");
 
+	migrate_legacy(h, true);
+
 	if (h->is_node())
 	{
 		publish_to_atomspace(h);
@@ -45,15 +49,22 @@ void DHTAtomStorage::store_recursive(const Handle& h)
 	for (const Handle& held: h->getOutgoingSet())
 		store_recursive(held);
 
-	// Only after adding leaves, add the atom.
-	publish_to_atomspace(h);
+	// Only after adding leaves, add the atom. If it was already
+	// published, then so were the incoming-set records for it;
+	// these never change, and so there is no need to send them again.
+	if (not publish_to_atomspace(h))
+	{
+		_num_link_repeats++;
+		return;
+	}
 
-	// Finally, update the incoming sets.
+	// Finally, update the incoming sets. These can get very large,
+	// and so are kept in a large set, rooted at the MUID.
 	dht::InfoHash holderguid = get_guid(h);
 	for (const Handle& held: h->getOutgoingSet())
 	{
 		dht::InfoHash memuid = get_membership(held);
-		_runner.put(memuid,
+		large_set_insert(memuid, holderguid,
 			dht::Value(_incoming_policy, holderguid, h->get_hash()));
 	}
 	_num_link_inserts++;
@@ -65,34 +76,37 @@ void DHTAtomStorage::store_recursive(const Handle& h)
  *
  * The actual store is done asynchronously (in a different thread)
  * by the DHT library; thus this method will typically return before
- * the store has completed.
+ * the store has completed. In write-behind mode, even the encoding
+ * is deferred to the writer thread; see DHTWriteBack.cc.
  */
 void DHTAtomStorage::storeAtom(const Handle& h, bool synchronous)
 {
+	if (_write_behind and not synchronous)
+	{
+		write_behind(h);
+		return;
+	}
+
 	store_atom_values(h);
 	store_recursive(h);
 }
 
 /* ================================================================== */
 /**
- * Publish Atom to the AtomSpace
+ * Publish Atom to the AtomSpace. Returns false if the Atom had
+ * already been published, and so nothing was done.
  */
-void DHTAtomStorage::publish_to_atomspace(const Handle& atom)
+bool DHTAtomStorage::publish_to_atomspace(const Handle& atom)
 {
 	if (_observing_only)
 		throw IOException(TRACE_INFO, "DHT Node is only observing!");
 
-	std::unique_lock<std::mutex> lck(_publish_mutex);
-	const auto& pa = _published.find(atom);
-	if (_published.end() != pa) return;
-
-	lck.unlock();
+	if (_published.contains(atom)) return false;
 
 	// Publish the generic AtomSpace encoding.
 	// These will always have a dht-id of "1", so that only one copy
 	// is kept around.
-	std::string gstr = Sexpr::encode_atom(atom);
-	_runner.put(get_guid(atom), dht::Value(_atom_policy, gstr, 1));
+	put_stuff(get_guid(atom), dht::Value(ATOM_ID, encode_atom(atom), 1));
 
 	// Put the atom into the atomspace.
 	// These will have a dht-id that is the atom hash, thus allowing
@@ -104,13 +118,61 @@ void DHTAtomStorage::publish_to_atomspace(const Handle& atom)
 	// We also have to mark the atom with a timestamp, to guarantee
 	// forward progress in the case that it is deleted later, and then
 	// added again.
-	std::string astr = "add " + std::to_string(now()) + " " + gstr;
-	_runner.put(_atomspace_hash,
-	            dht::Value(_space_policy, astr, atom->get_hash()));
-
-	lck.lock();
-	_published.emplace(atom);
+	//
+	// The AtomSpace itself is split into buckets; see get_space_bucket()
+	std::string astr = space_record("add", atom);
+	put_stuff(get_space_bucket(atom),
+	          dht::Value(_space_policy, astr, atom->get_hash()));
+
+	// Also put the atom into the per-type index, so that loadType()
+	// does not need to wade through the entire AtomSpace.
+	put_stuff(get_type_bucket(atom),
+	          dht::Value(_space_policy, astr, atom->get_hash()));
+
+	// Mark the AtomSpace as having a type index; the marker is always
+	// identical, and so, like the large-set split markers, it uses
+	// the trie policy.
+	if (not _type_indexed.exchange(true))
+		put_stuff(space_key(_atomspace_name, "type-index"),
+		          dht::Value(_trie_policy, std::string("type-index"), 1));
+
+	_published.put(atom, true);
 	_store_count ++;
+	return true;
+}
+
+/**
+ * Encode the immutable Atom into a binary (MessagePack) record, as
+ *
+ *    [ATOM_FORMAT, type-name, name]           for Nodes
+ *    [ATOM_FORMAT, type-name, [guid, ...]]    for Links
+ *
+ * The outgoing set of a Link is given by the GUIDs of its Atoms, and
+ * not by their full contents; thus, the record size is proportional
+ * to the arity of the Link, and not to the size of the whole tree
+ * under it.
+ */
+dht::Blob DHTAtomStorage::encode_atom(const Handle& atom)
+{
+	msgpack::sbuffer buf;
+	msgpack::packer<msgpack::sbuffer> pk(&buf);
+
+	pk.pack_array(3);
+	pk.pack((int) ATOM_FORMAT);
+	pk.pack(nameserver().getTypeName(atom->get_type()));
+	if (atom->is_node())
+	{
+		pk.pack(atom->get_name());
+	}
+	else
+	{
+		const HandleSeq& oset = atom->getOutgoingSet();
+		pk.pack_array(oset.size());
+		for (const Handle& held : oset)
+			pk.pack(get_guid(held));
+	}
+
+	return dht::Blob(buf.data(), buf.data() + buf.size());
 }
 
 /* ================================================================== */
@@ -121,21 +183,43 @@ void DHTAtomStorage::publish_to_atomspace(const Handle& atom)
  * incoming set, or AtomSpace that it belongs to. Its just the pure
  * Atom.
  *
+ * The hash is built Merkle-style: for Nodes, it is the SHA-1 of the
+ * type name and the Node name; for Links, it is the SHA-1 of the type
+ * name and the GUIDs of the outgoing set. Since the GUIDs of the
+ * outgoing set are cached, the cost is proportional to the arity of
+ * the Link, and not to the size of the whole tree under it.
+ *
+ * The string being hashed starts with the GUID_FORMAT version tag.
+ * Type names never contain blanks, and so Node and Link strings can
+ * never collide with one-another.
+ *
  * XXX TODO this should use all of the hashing and alpha-equivalence
  * rules that ContentHash Atom::compute_hash() const uses.
- * !! Perhaps we should extend class Atom to provide both 20-byte
- * (160 bit) and larger (256 bit) hashes? Yes, we should!
- * That would avoid bugs & shit...
  */
 dht::InfoHash DHTAtomStorage::get_guid(const Handle& h)
 {
-	std::lock_guard<std::mutex> lck(_guid_mutex);
-	const auto& ip = _guid_map.find(h);
-	if (_guid_map.end() != ip)
-		return ip->second;
-	std::string gstr = Sexpr::encode_atom(h);
-	dht::InfoHash gkey = dht::InfoHash::get(gstr);
-	_guid_map[h] = gkey;
+	dht::InfoHash gkey;
+	if (_guid_map.get(h, gkey))
+		return gkey;
+
+	// The hashing is done without holding any locks.
+	// If two threads race to do this, they get the same answer.
+	std::string gstr = "v" + std::to_string(GUID_FORMAT) + " "
+		+ nameserver().getTypeName(h->get_type()) + " ";
+	if (h->is_node())
+	{
+		gstr += h->get_name();
+	}
+	else
+	{
+		for (const Handle& held : h->getOutgoingSet())
+		{
+			dht::InfoHash hguid = get_guid(held);
+			gstr.append((const char*) hguid.data(), hguid.size());
+		}
+	}
+	gkey = dht::InfoHash::get(gstr);
+	_guid_map.put(h, gkey);
 	return gkey;
 }
 
@@ -144,20 +228,200 @@ dht::InfoHash DHTAtomStorage::get_guid(const Handle& h)
  * Return the AtomSpace-specific (bus still globally-unique) hash
  * corresponding to the Atom, in this AtomSpace.  This hash is
  * required for looking up values and incoming sets.
+ *
+ * It is the SHA-1 of the AtomSpace hash, followed by the GUID.
  */
 dht::InfoHash DHTAtomStorage::get_membership(const Handle& h)
 {
-	std::lock_guard<std::mutex> lck(_membership_mutex);
-	const auto& ip = _membership_map.find(h);
-	if (_membership_map.end() != ip)
-		return ip->second;
-
-	std::string astr = _atomspace_name + Sexpr::encode_atom(h);
-	dht::InfoHash akey = dht::InfoHash::get(astr);
-	_membership_map[h] = akey;
+	dht::InfoHash akey;
+	if (_membership_map.get(h, akey))
+		return akey;
+
+	dht::InfoHash guid = get_guid(h);
+	std::string astr((const char*) _atomspace_hash.data(),
+	                 _atomspace_hash.size());
+	astr.append((const char*) guid.data(), guid.size());
+	akey = dht::InfoHash::get(astr);
+	_membership_map.put(h, akey);
 	return akey;
 }
 
+/**
+ * Return the membership hash that was used before GUID_FORMAT was
+ * introduced. This is needed only to find the Values and incoming
+ * sets of Atoms that were stored with the older format; the loader
+ * remembers it, when it sees an old record (see read_membership()).
+ */
+dht::InfoHash DHTAtomStorage::legacy_membership(const Handle& h)
+{
+	return dht::InfoHash::get(_atomspace_name + Sexpr::encode_atom(h));
+}
+
+/**
+ * Return the hash under which the Values and the incoming set of the
+ * Atom are to be found. This is the older membership hash, for Atoms
+ * that were stored with the older format, and have not been moved
+ * over yet; otherwise, it is the same as get_membership().
+ */
+dht::InfoHash DHTAtomStorage::read_membership(const Handle& h)
+{
+	{
+		std::lock_guard<std::mutex> lck(_legacy_mutex);
+		auto it = _legacy_muids.find(h);
+		if (_legacy_muids.end() != it) return it->second;
+	}
+	return get_membership(h);
+}
+
+/// Return true if the Atom was seen only in a format-0 membership
+/// record, and has not been moved over yet.
+bool DHTAtomStorage::is_legacy(const Handle& h)
+{
+	std::lock_guard<std::mutex> lck(_legacy_mutex);
+	return _legacy_muids.end() != _legacy_muids.find(h);
+}
+
+/**
+ * Move an Atom that was stored with the older format over to the
+ * current one. All writes go to the current MUID; thus, before
+ * anything is written for such an Atom, its incoming set (and, if
+ * `copy_values` is set, its Values) are copied over from the older
+ * MUID, and the Atom is to be published again, with a current
+ * membership record. After that, readers find everything under the
+ * current MUID.
+ *
+ * The copies are made in the background; barrier() waits for them.
+ * Does nothing, if the Atom is not a format-0 Atom.
+ */
+void DHTAtomStorage::migrate_legacy(const Handle& h, bool copy_values)
+{
+	dht::InfoHash lmuid;
+	{
+		std::lock_guard<std::mutex> lck(_legacy_mutex);
+		auto it = _legacy_muids.find(h);
+		if (_legacy_muids.end() == it) return;
+		lmuid = it->second;
+		_legacy_muids.erase(it);
+	}
+	dht::InfoHash muid = get_membership(h);
+
+	// The Values record is copied as-is; there is no need to decode it.
+	if (copy_values)
+	{
+		get_async(lmuid,
+			[this, muid](ValueSeq&& dvals)
+			{
+				std::shared_ptr<dht::Value> latest;
+				for (const auto& dval : dvals)
+					if (nullptr == latest or latest->id < dval->id)
+						latest = dval;
+				if (nullptr == latest) return;
+				put_stuff(muid, dht::Value(VALUES_ID, latest->data, 1));
+				bloom_add(muid);
+			}, _values_filter, &_migrations);
+	}
+
+	static dht::InfoHash zerohash;
+	large_set_walk(lmuid, "",
+		[this, muid](ValueSeq&& dincs)
+		{
+			for (const auto& dinc : dincs)
+			{
+				dht::InfoHash inhash = dinc->unpack<dht::InfoHash>();
+				if (inhash == zerohash) continue;
+				large_set_insert(muid, inhash,
+					dht::Value(_incoming_policy, inhash, dinc->id));
+			}
+		}, &_migrations);
+
+	// Publish it again, when it is next stored.
+	_published.erase(h);
+	_num_migrations++;
+}
+
+/**
+ * Create an AtomSpace membership record, of the form
+ * "add <timestamp> v<GUID_FORMAT> <scheme string>" (or "drop ...").
+ * The timestamp guarantees forward progress, when an Atom is added,
+ * deleted and added again; the version tells readers how the GUID
+ * and MUID of the Atom were computed.
+ */
+std::string DHTAtomStorage::space_record(const char* verb, const Handle& h)
+{
+	return std::string(verb) + " " + std::to_string(now())
+		+ " v" + std::to_string(GUID_FORMAT)
+		+ " " + Sexpr::encode_atom(h);
+}
+
+/* ================================================================== */
+/**
+ * Return a DHT key belonging to the named AtomSpace. The `what` says
+ * which of the keys it is. The two are joined with a NUL byte, which
+ * cannot occur in an AtomSpace name; thus, the keys of different
+ * AtomSpaces can never collide ("foo1" + "2" vs. "foo" + "12"), nor
+ * can they collide with the hash of a bare AtomSpace name.
+ */
+dht::InfoHash DHTAtomStorage::space_key(const std::string& spacename,
+                                        const std::string& what)
+{
+	std::string str(spacename);
+	str.push_back('\0');
+	str += what;
+	return dht::InfoHash::get(str);
+}
+
+/**
+ * Return the DHT key for the indicated bucket of the named AtomSpace.
+ *
+ * OpenDHT limits the number of values, and the number of bytes, that
+ * can be attached to a single key. Thus, the AtomSpace membership
+ * list cannot be kept on a single key; it is instead scattered over
+ * NUM_SPACE_BUCKETS different keys. Since each of these keys hashes
+ * to a different location, the membership list is spread over many
+ * different DHT nodes, instead of being pinned to just one.
+ */
+dht::InfoHash DHTAtomStorage::get_bucket(const std::string& spacename,
+                                         size_t bucket)
+{
+	return space_key(spacename, "bucket/" + std::to_string(bucket));
+}
+
+/**
+ * Return the membership bucket that the Atom belongs to, in this
+ * AtomSpace. The bucket is chosen from the low bits of the 64-bit
+ * Atom hash; this is the same hash that is used as the dht-id of the
+ * membership record, and so the "add" and "drop" records for an Atom
+ * always land in the same bucket.
+ */
+dht::InfoHash DHTAtomStorage::get_space_bucket(const Handle& h)
+{
+	return get_bucket(_atomspace_name, h->get_hash() % NUM_SPACE_BUCKETS);
+}
+
+/**
+ * Return the DHT key holding one bucket of the index of all Atoms of
+ * the given type, in the named AtomSpace. The records on this key are
+ * the same "add" and "drop" records that are placed in the membership
+ * buckets. Common types, such as ConceptNode, can have as many Atoms
+ * as the whole AtomSpace; thus the index, too, is split over
+ * NUM_TYPE_BUCKETS keys, for the same reasons as the membership list.
+ */
+dht::InfoHash DHTAtomStorage::get_type_index(const std::string& spacename,
+                                             Type t, size_t bucket)
+{
+	return space_key(spacename, "type/" + nameserver().getTypeName(t) +
+	                            "/" + std::to_string(bucket));
+}
+
+/// Return the type index bucket that the Atom belongs to. As with
+/// get_space_bucket(), this is picked from the Atom hash, and so the
+/// "add" and "drop" records land in the same bucket.
+dht::InfoHash DHTAtomStorage::get_type_bucket(const Handle& h)
+{
+	return get_type_index(_atomspace_name, h->get_type(),
+	                      h->get_hash() % NUM_TYPE_BUCKETS);
+}
+
 /* ================================================================== */
 
 bool DHTAtomStorage::cy_store_atom(dht::InfoHash key,
@@ -261,7 +525,29 @@ bool DHTAtomStorage::cy_edit_values(dht::InfoHash key,
 
 	// All values are given the value->id==1 and so all value updates
 	// go through this callback.  Returning `true` here will cause
-	// the old_val to be dropped and replaced by `new_val`.
+	// the old_val to be dropped and replaced by `new_val`. Counters
+	// in the old_val are first merged into the new_val.
+	try { merge_counters(old_val->data, new_val->data); }
+	catch (const std::exception& ex) {}
+	return true;
+}
+
+bool DHTAtomStorage::cy_edit_bloom(dht::InfoHash key,
+                              const std::shared_ptr<dht::Value>& old_val,
+                              std::shared_ptr<dht::Value>& new_val,
+                              const dht::InfoHash& from,
+                              const dht::SockAddr& addr)
+{
+	// The has-values summary segments are Bloom filters; bits are
+	// only ever set, never cleared. Keep the bits set by everyone,
+	// by merging the old segment into the new one. The completeness
+	// marker is just replaced.
+	if (BLOOM_SEGMENT_BYTES == new_val->data.size() and
+	    old_val->data.size() == new_val->data.size())
+	{
+		for (size_t i = 0; i < new_val->data.size(); i++)
+			new_val->data[i] |= old_val->data[i];
+	}
 	return true;
 }
 
@@ -290,6 +576,15 @@ bool DHTAtomStorage::cy_edit_incoming(dht::InfoHash key,
 	// `true` here will cause the old_val to be dropped and replaced by
 	// `new_val`. There should only ever be two possible vales: the guid
 	// of the holder, or zero (deleted/discarded).
+	//
+	// If the new value is the same as the old, then there is nothing
+	// to do; returning `false` keeps the old one, and avoids any
+	// further work (such as announcing it to listeners.)
+	if (old_val->data == new_val->data)
+	{
+		_incoming_dups++;
+		return false;
+	}
 	return true;
 }
 
@@ -0,0 +1,341 @@
+/*
+ * DHTBloom.cc
+ * Summary of which Atoms have Values, to avoid pointless fetches.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <msgpack.hpp>
+
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================== */
+/*
+ * Most Atoms (most Nodes, in particular) never have any Values, yet
+ * fetching them costs a DHT get, and a get for a key that holds
+ * nothing is the slowest kind, as it waits for the search to give up.
+ *
+ * Thus, each AtomSpace publishes a Bloom filter of the MUIDs of the
+ * Atoms that have Values. It is split into NUM_BLOOM_SEGMENTS
+ * segments, each on its own DHT key; the segment is picked by the
+ * first byte of the MUID. A writer sets the bits for an Atom when it
+ * first stores Values on it, and puts the segment; the edit policy on
+ * the storing node ORs the new segment into the old one, so that the
+ * bits set by different writers are all kept.
+ *
+ * Bits that are set only say that the Atom might have Values; a clear
+ * bit says nothing, unless every Atom with Values is known to have
+ * had its bits set. Data written before the summary existed, or by
+ * writers that do not keep it, has no bits. Thus, each segment also
+ * carries a completeness marker, holding the BLOOM_FORMAT. The marker
+ * is only put by a node that has just loaded the entire AtomSpace,
+ * and so knows every Atom that has Values; see bloom_complete(). From
+ * then on, the writers keep the bits up to date.
+ *
+ * A reader skips the Value fetch only if the bits are clear in a
+ * segment that it actually got from the DHT, with a marker of the
+ * current format. A segment that could not be fetched, or that has no
+ * marker, says nothing. Atoms in the older MUID format (see
+ * read_membership()) never had bits set, and are always fetched. The
+ * local copy of a segment is fetched again after BLOOM_REFRESH secs,
+ * so that Values stored by others are eventually noticed.
+ */
+
+#define BLOOM_REFRESH 60
+
+// The value ids of the bits, and of the completeness marker.
+#define BLOOM_BITS_VID 1
+#define BLOOM_MARKER_VID 2
+
+/// The DHT key of the given segment of the named AtomSpace.
+dht::InfoHash DHTAtomStorage::bloom_key(const std::string& spacename,
+                                        size_t seg)
+{
+	return space_key(spacename, "has-values/" + std::to_string(seg));
+}
+
+/// The bits for the MUID. The MUID is already a cryptographic hash;
+/// different byte pairs of it serve as independent hashes.
+static void bloom_bits(const dht::InfoHash& muid, size_t bits[])
+{
+	for (size_t i = 0; i < DHTAtomStorage::BLOOM_HASHES; i++)
+		bits[i] = ((muid[1+2*i] << 8) | muid[2+2*i]) %
+			(8 * DHTAtomStorage::BLOOM_SEGMENT_BYTES);
+}
+
+/// OR the segment records into the local copy of the segment.
+static void bloom_merge(dht::Blob& bits,
+                        const std::vector<std::shared_ptr<dht::Value>>& dvals)
+{
+	for (const auto& dval : dvals)
+	{
+		if (BLOOM_BITS_VID != dval->id) continue;
+		if (dval->data.size() != bits.size()) continue;
+		for (size_t i = 0; i < bits.size(); i++)
+			bits[i] |= dval->data[i];
+	}
+}
+
+/// Return true if one of the segment records is a completeness marker
+/// of the current format.
+static bool bloom_marked(const std::vector<std::shared_ptr<dht::Value>>& dvals)
+{
+	for (const auto& dval : dvals)
+	{
+		if (BLOOM_MARKER_VID != dval->id) continue;
+		try
+		{
+			msgpack::object_handle oh = msgpack::unpack(
+				(const char*) dval->data.data(), dval->data.size());
+			if (DHTAtomStorage::BLOOM_FORMAT == oh.get().as<int>())
+				return true;
+		}
+		catch (const std::exception& ex) {}
+	}
+	return false;
+}
+
+/**
+ * Record that the Atom with this MUID has Values. Puts the segment,
+ * if any new bits had to be set.
+ */
+void DHTAtomStorage::bloom_add(const dht::InfoHash& muid)
+{
+	size_t bits[BLOOM_HASHES];
+	bloom_bits(muid, bits);
+
+	std::unique_lock<std::mutex> lck(_bloom_mutex);
+	BloomSegment& seg = _bloom[muid[0]];
+	if (seg.bits.empty()) seg.bits.resize(BLOOM_SEGMENT_BYTES, 0);
+
+	bool changed = false;
+	for (size_t i = 0; i < BLOOM_HASHES; i++)
+	{
+		uint8_t mask = 1 << (bits[i] % 8);
+		if (seg.bits[bits[i] / 8] & mask) continue;
+		seg.bits[bits[i] / 8] |= mask;
+		changed = true;
+	}
+	if (not changed) return;
+
+	dht::Blob blob(seg.bits);
+	lck.unlock();
+	put_stuff(bloom_key(_atomspace_name, muid[0]),
+	          dht::Value(BLOOM_ID, blob, BLOOM_BITS_VID));
+}
+
+/// Check the local copy of the segment. Returns false if the Atom
+/// with this MUID certainly has no Values.
+bool DHTAtomStorage::bloom_test(const dht::InfoHash& muid)
+{
+	size_t bits[BLOOM_HASHES];
+	bloom_bits(muid, bits);
+
+	std::lock_guard<std::mutex> lck(_bloom_mutex);
+	const BloomSegment& seg = _bloom[muid[0]];
+	if (not seg.complete) return true;
+	for (size_t i = 0; i < BLOOM_HASHES; i++)
+		if (0 == (seg.bits[bits[i] / 8] & (1 << (bits[i] % 8))))
+			return false;
+	return true;
+}
+
+/**
+ * Return false if the Atom with this MUID certainly has no Values.
+ * Return true if it might. This does not wait: if the local copy of
+ * the segment is missing or stale, a fresh one is fetched in the
+ * background, and the answer, for now, is that the Atom might.
+ */
+bool DHTAtomStorage::bloom_may_have(const dht::InfoHash& muid)
+{
+	size_t segno = muid[0];
+	time_t now = time(0);
+	bool fresh;
+	{
+		std::lock_guard<std::mutex> lck(_bloom_mutex);
+		const BloomSegment& seg = _bloom[segno];
+		fresh = seg.fetched and now < seg.when + BLOOM_REFRESH;
+	}
+
+	if (not fresh)
+	{
+		bloom_when_fresh(segno, [](bool ok) {});
+		return true;
+	}
+	return bloom_test(muid);
+}
+
+/// Same as above, except that the answer comes from a fresh segment.
+/// It is passed to `then`; right away, if the local copy of the
+/// segment is fresh, else on a dispatcher thread, after the segment
+/// has arrived.
+void DHTAtomStorage::bloom_may_have_async(const dht::InfoHash& muid,
+                                          std::function<void(bool)> then)
+{
+	bloom_when_fresh(muid[0], [this, muid, then](bool ok)
+	{
+		then(not ok or bloom_test(muid));
+	});
+}
+
+/**
+ * Run `then` once the local copy of the segment is fresh. If it is
+ * not, then it is fetched from the DHT, without waiting, and `then`
+ * is run on a dispatcher thread, after it arrives. All of the checks
+ * waiting on the same segment share a single get. `then` is passed
+ * false, if the segment could not be fetched.
+ */
+void DHTAtomStorage::bloom_when_fresh(size_t segno,
+                                      std::function<void(bool)>&& then)
+{
+	time_t now = time(0);
+	bool fresh;
+	{
+		std::lock_guard<std::mutex> lck(_bloom_mutex);
+		BloomSegment& seg = _bloom[segno];
+		fresh = seg.fetched and now < seg.when + BLOOM_REFRESH;
+		if (not fresh)
+		{
+			seg.waiting.emplace_back(std::move(then));
+			if (1 < seg.waiting.size()) return;
+		}
+	}
+	if (fresh)
+	{
+		then(true);
+		return;
+	}
+
+	// Only the DHT runner thread touches `vals`, until it is handed
+	// over to the dispatcher.
+	auto vals = std::make_shared<ValueSeq>();
+	_runner.get(bloom_key(_atomspace_name, segno),
+		[vals](const ValueSeq& got)->bool
+		{
+			vals->insert(vals->end(), got.begin(), got.end());
+			return true;
+		},
+		[this, segno, now, vals]
+		(bool ok, const std::vector<std::shared_ptr<dht::Node>>&)
+		{
+			if (not dispatch([this, segno, now, vals, ok](void)
+				{ bloom_loaded(segno, ok, *vals, now); }))
+				bloom_loaded(segno, false, ValueSeq(), now);
+		},
+		_bloom_filter);
+}
+
+/// The segment has arrived; run the checks that were waiting on it.
+void DHTAtomStorage::bloom_loaded(size_t segno, bool ok,
+                                  const ValueSeq& dvals, time_t when)
+{
+	if (ok) bloom_update(segno, dvals, when);
+
+	std::vector<std::function<void(bool)>> waiting;
+	{
+		std::lock_guard<std::mutex> lck(_bloom_mutex);
+		waiting.swap(_bloom[segno].waiting);
+	}
+	for (auto& then : waiting)
+	{
+		try { then(ok); }
+		catch (const std::exception& ex)
+		{
+			logger().warn("Has-values check failed: %s", ex.what());
+		}
+	}
+}
+
+/// Merge freshly-fetched segment records into the local copy.
+void DHTAtomStorage::bloom_update(size_t segno, const ValueSeq& dvals,
+                                  time_t when)
+{
+	std::lock_guard<std::mutex> lck(_bloom_mutex);
+	BloomSegment& seg = _bloom[segno];
+	if (seg.bits.empty()) seg.bits.resize(BLOOM_SEGMENT_BYTES, 0);
+	bloom_merge(seg.bits, dvals);
+	seg.complete = seg.complete or bloom_marked(dvals);
+	seg.fetched = true;
+	seg.when = when;
+}
+
+/**
+ * Publish the bits for all of the Atoms that have Values, and mark
+ * every segment as complete. This may only be done right after a full
+ * load, when `muids` are the MUIDs of every Atom in the AtomSpace that
+ * has Values. Does nothing, if all of the segments are already marked.
+ */
+void DHTAtomStorage::bloom_complete(const std::vector<dht::InfoHash>& muids)
+{
+	{
+		std::lock_guard<std::mutex> lck(_bloom_mutex);
+		bool all = true;
+		for (const BloomSegment& seg : _bloom)
+			all = all and seg.complete;
+		if (all) return;
+	}
+
+	msgpack::sbuffer buf;
+	msgpack::packer<msgpack::sbuffer> pk(&buf);
+	pk.pack((int) BLOOM_FORMAT);
+	dht::Blob marker(buf.data(), buf.data() + buf.size());
+
+	std::vector<dht::Blob> segs(NUM_BLOOM_SEGMENTS,
+	                            dht::Blob(BLOOM_SEGMENT_BYTES, 0));
+	size_t bits[BLOOM_HASHES];
+	for (const dht::InfoHash& muid : muids)
+	{
+		bloom_bits(muid, bits);
+		for (size_t i = 0; i < BLOOM_HASHES; i++)
+			segs[muid[0]][bits[i] / 8] |= 1 << (bits[i] % 8);
+	}
+
+	for (size_t segno = 0; segno < NUM_BLOOM_SEGMENTS; segno++)
+	{
+		{
+			std::lock_guard<std::mutex> lck(_bloom_mutex);
+			BloomSegment& seg = _bloom[segno];
+			if (seg.bits.empty()) seg.bits.resize(BLOOM_SEGMENT_BYTES, 0);
+			for (size_t i = 0; i < BLOOM_SEGMENT_BYTES; i++)
+				segs[segno][i] |= seg.bits[i];
+			seg.bits = segs[segno];
+			seg.complete = true;
+		}
+
+		// The bits are put before the marker.
+		dht::InfoHash bkey(bloom_key(_atomspace_name, segno));
+		put_stuff(bkey, dht::Value(BLOOM_ID, segs[segno], BLOOM_BITS_VID));
+		put_stuff(bkey, dht::Value(BLOOM_ID, marker, BLOOM_MARKER_VID));
+		put_throttle();
+	}
+}
+
+/**
+ * Fetch all of the segments that are not fresh, all at once. This is
+ * done before bulk loads, so that the segments are not fetched one at
+ * a time. Segments that cannot be fetched are simply not trusted.
+ */
+void DHTAtomStorage::bloom_prefetch(void)
+{
+	InFlight ifl;
+	for (size_t segno = 0; segno < NUM_BLOOM_SEGMENTS; segno++)
+	{
+		{
+			std::lock_guard<std::mutex> lck(ifl.mtx);
+			ifl.busy++;
+		}
+		std::shared_ptr<InFlight::Ref> ref(ifl.ref);
+		bloom_when_fresh(segno, [ref](bool ok)
+		{
+			inflight_done(ref, nullptr);
+		});
+	}
+	inflight_drain(ifl);
+}
+
+/* ============================= END OF FILE ================= */
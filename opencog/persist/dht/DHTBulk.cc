@@ -9,6 +9,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/atoms/base/Link.h>
@@ -22,129 +26,436 @@ using namespace opencog;
 
 /* ================================================================ */
 
+/// Get all of the values on all of the keys.
+///
+/// All of the gets are issued up front, before waiting on any of them;
+/// the DHT runner thread services them concurrently, so the wall-clock
+/// time is about that of one round-trip, and not one round-trip per
+/// key. Each get is waited on as in get_stuff(): a slow one is hedged,
+/// and one that times out, or fails, is tried again.
+std::vector<std::shared_ptr<dht::Value>>
+DHTAtomStorage::get_keys(const std::vector<dht::InfoHash>& keys)
+{
+	std::vector<std::shared_ptr<GetCall>> calls;
+	calls.reserve(keys.size());
+	for (const auto& key : keys)
+	{
+		calls.emplace_back(std::make_shared<GetCall>());
+		issue_get(calls.back(), key, _space_filter, SPACE_KEYS);
+	}
+
+	std::vector<std::shared_ptr<dht::Value>> atovs;
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		auto bvals = get_wait(calls[i], keys[i], _space_filter, SPACE_KEYS);
+		atovs.insert(atovs.end(), bvals.begin(), bvals.end());
+	}
+	return atovs;
+}
+
+/// Get all of the membership records for the named AtomSpace.
+///
+/// The records are scattered over NUM_SPACE_BUCKETS bucket keys (see
+/// get_bucket()).
+///
+/// The un-bucketed key (the hash of the AtomSpace name itself) is
+/// fetched as well, so that AtomSpaces written with the older,
+/// single-key layout can still be loaded.
+std::vector<std::shared_ptr<dht::Value>>
+DHTAtomStorage::get_space(const std::string& spacename)
+{
+	std::vector<dht::InfoHash> keys;
+	keys.reserve(NUM_SPACE_BUCKETS + 1);
+	keys.emplace_back(dht::InfoHash::get(spacename));
+	for (size_t bucket = 0; bucket < NUM_SPACE_BUCKETS; bucket++)
+		keys.emplace_back(get_bucket(spacename, bucket));
+	return get_keys(keys);
+}
+
+/* ================================================================ */
+
+/// Parse an AtomSpace membership record. The format is the string
+/// "add" or "drop", followed by a timestamp, followed by an optional
+/// version tag "v<GUID_FORMAT>", followed by the scheme string.
+/// Records written before the version tag was introduced are format
+/// zero. Returns false if the record is not recognizable.
+bool DHTAtomStorage::parse_space_record(const std::string& sname,
+                                        SpaceRecord& rec)
+{
+#define ADD_ATOM "add "
+#define DROP_ATOM "drop "
+	size_t pos;
+	if (0 == sname.compare(0, sizeof(ADD_ATOM)-1, ADD_ATOM))
+	{
+		rec.add = true;
+		pos = sizeof(ADD_ATOM)-1;
+	}
+	else if (0 == sname.compare(0, sizeof(DROP_ATOM)-1, DROP_ATOM))
+	{
+		rec.add = false;
+		pos = sizeof(DROP_ATOM)-1;
+	}
+	else return false;
+
+	const char* start = sname.c_str() + pos;
+	char* end;
+	rec.stamp = strtod(start, &end);
+	if (end == start) return false;
+	pos += end - start;
+
+	while (pos < sname.size() and ' ' == sname[pos]) pos++;
+	rec.format = 0;
+	if (pos < sname.size() and 'v' == sname[pos])
+	{
+		rec.format = atoi(sname.c_str() + pos + 1);
+		pos = sname.find(' ', pos);
+	}
+
+	rec.pos = sname.find('(', pos);
+	return std::string::npos != rec.pos;
+}
+
+/// Decode the Atom in a membership record.  If the record was written
+/// with an older GUID_FORMAT, then the Values and the incoming set of
+/// the Atom are to be found under the older membership hash; remember
+/// that, so that later fetches go there (see read_membership()).
+Handle DHTAtomStorage::decode_space_record(const std::string& sname,
+                                           const SpaceRecord& rec)
+{
+	size_t pos = rec.pos;
+	Handle h(Sexpr::decode_atom(sname, pos));
+	if (0 == rec.format)
+	{
+		std::lock_guard<std::mutex> lck(_legacy_mutex);
+		_legacy_muids.emplace(h, legacy_membership(h));
+	}
+	return h;
+}
+
+/* ================================================================ */
+
 /// load_atomspace -- load the AtomSpace with the given name.
+///
+/// If `incremental` is set, then only the membership records that were
+/// not applied by a previous load of this AtomSpace are applied: their
+/// Atoms are added (or, for "drop" records, removed), and only their
+/// Values are fetched. All of the records are still fetched, as the
+/// DHT cannot select them by time; but the decoding and the Value
+/// fetches, which are most of the cost, are skipped for the unchanged
+/// ones. A record is recognized as applied by its Atom and timestamp;
+/// thus, records written by a node with a lagging clock, or that
+/// arrive late, are not missed.
+///
+/// The same Atom may have several records: an "add" followed by a
+/// "drop", or copies under both the old and the bucketed keys. The
+/// one with the latest timestamp wins.
 void DHTAtomStorage::load_atomspace(AtomSpace* as,
-                                    const std::string& spacename)
+                                    const std::string& spacename,
+                                    bool incremental)
 {
 	size_t start_count = _load_count;
-	printf("Loading all atoms from %s\n", spacename.c_str());
+	printf("Loading %s atoms from %s\n",
+	       incremental ? "new" : "all", spacename.c_str());
 	time_t bulk_start = time(0);
 
-	dht::InfoHash space_hash = dht::InfoHash::get(spacename);
-
-	// XXX FIXME, when working on the Atomspace, we need
-	// a longer timeout!?!!!
 	std::cout << "Start waiting for atomspace" << std::endl;
-	auto atovs = get_stuff(space_hash);
+	auto atovs = get_space(spacename);
 	std::cout << "Done waiting for atomspace" << std::endl;
 
-	for (auto ato: atovs)
+	// Pick the latest record for each Atom. The DHT value id is the
+	// Atom hash.
+	struct Latest
+	{
+		SpaceRecord rec;
+		std::string sname;
+	};
+	std::unordered_map<dht::Value::Id, Latest> latest;
+	for (const auto& ato: atovs)
 	{
 		std::string sname = ato->unpack<std::string>();
 
-		// Currently, the format is the string "add" or "drop",
-		// followed by a timestamp, followed by the scheme string.
-		// Ignore anything that doesn't start with "add"
-#define ADD_ATOM "add "
-	   if (sname.compare(0, sizeof(ADD_ATOM)-1, ADD_ATOM))
+		SpaceRecord rec;
+		if (not parse_space_record(sname, rec)) continue;
+
+		auto it = latest.find(ato->id);
+		if (latest.end() != it and rec.stamp <= it->second.rec.stamp)
 			continue;
+		latest[ato->id] = {rec, std::move(sname)};
+	}
 
-		std::cout << "Load Atom " << sname << std::endl;
-		// pos is always 22 because the prefix is "add 1572978874.801600 "
-		// at least it will be for the next bijillion seconds.
-		// size_t pos = sname.find('(');
-		size_t pos = sizeof("add 1572978874.801600");
-		Handle h(Sexpr::decode_atom(sname, pos));
-		as->add_atom(fetch_values(std::move(h)));
-		_load_count++;
+	// Skip the records that were already applied. Atoms that are
+	// already in the AtomSpace are not fetched again, anyway.
+	size_t nstale = 0;
+	if (incremental)
+	{
+		std::lock_guard<std::mutex> lck(_mark_mutex);
+		const auto& seen = _space_seen[spacename];
+		for (auto it = latest.begin(); it != latest.end(); )
+		{
+			auto sit = seen.find(it->first);
+			if (seen.end() != sit and it->second.rec.stamp <= sit->second)
+			{
+				nstale++;
+				it = latest.erase(it);
+			}
+			else it++;
+		}
 	}
 
+	// Decode all of the Atoms first; this is local CPU work only.
+	HandleSeq hseq;
+	size_t ndrops = 0;
+	for (const auto& pr: latest)
+	{
+		const Latest& lat = pr.second;
+		Handle h(decode_space_record(lat.sname, lat.rec));
+
+		// A full load only adds; an incremental one follows deletions.
+		if (not lat.rec.add)
+		{
+			if (incremental and drop_local(as, h)) ndrops++;
+			continue;
+		}
+		if (incremental and as->get_atom(h)) continue;
+
+		// std::cout << "Load Atom " << lat.sname << std::endl;
+		hseq.emplace_back(h);
+	}
+
+	// Then go get the values, keeping many requests in flight.
+	// Atoms that certainly have no values are skipped.
+	bool complete = not incremental and spacename == _atomspace_name;
+	std::mutex vmtx;
+	std::vector<dht::InfoHash> have_values;
+	bloom_prefetch();
+	fetch_values_pipelined(std::move(hseq),
+		[&](const Handle& h)
+		{
+			if (complete and not h->getKeys().empty())
+			{
+				dht::InfoHash muid = read_membership(h);
+				std::lock_guard<std::mutex> lck(vmtx);
+				have_values.push_back(muid);
+			}
+			as->add_atom(h);
+			_load_count++;
+		});
+
+	// A full load has seen every Atom that has Values, and so the
+	// has-values summary can be marked as complete.
+	if (complete and not _observing_only)
+		bloom_complete(have_values);
+
+	{
+		std::lock_guard<std::mutex> lck(_mark_mutex);
+		auto& seen = _space_seen[spacename];
+		for (const auto& pr: latest)
+		{
+			double& last = seen[pr.first];
+			last = std::max(last, pr.second.rec.stamp);
+		}
+	}
+
+	size_t cnt = _load_count - start_count;
 	time_t secs = time(0) - bulk_start;
-	double rate = ((double) _load_count) / secs;
+	double rate = (0 < secs) ? ((double) cnt) / secs : 0.0;
 	printf("Finished loading %zu atoms in total in %d seconds (%d per second)\n",
-		(_load_count - start_count), (int) secs, (int) rate);
+		cnt, (int) secs, (int) rate);
+	if (incremental)
+		printf("Skipped %zu unchanged records; removed %zu atoms\n",
+		       nstale, ndrops);
 
 	// synchrnonize!
 	as->barrier();
 }
 
-/// A copy of the above.
-/// Inefficient, but it works. We could solve the inefficiency
-/// by maintaining an index of atoms-by-type in the DHT. This
-/// would certainly push more crap into the DHT ... is it worth
-/// it, to have this index?
+/// Return true if the AtomSpace was stored with a type index. Every
+/// writer that keeps the index puts a marker, when it first publishes
+/// an Atom; an empty index in a marked AtomSpace means that there are
+/// no Atoms of that type.
+bool DHTAtomStorage::has_type_index(void)
+{
+	if (_type_indexed) return true;
+
+	dht::InfoHash mkey(space_key(_atomspace_name, "type-index"));
+	auto marks = get_stuff(mkey, dht::Value::TypeFilter(_trie_policy),
+	                       SPACE_KEYS);
+	if (marks.empty()) return false;
+
+	_type_indexed = true;
+	return true;
+}
+
+/// Load all Atoms of the given type.
+///
+/// Every Atom is also published to a per-type index (see
+/// get_type_index()) and so only the NUM_TYPE_BUCKETS keys of that
+/// index need to be fetched; the cost is proportional to the number
+/// of Atoms of this type, and not to the size of the whole AtomSpace.
 ///
+/// AtomSpaces stored before the type index existed have nothing in
+/// the index, and no marker saying that they have one (see
+/// has_type_index()); for these, the entire membership list is
+/// fetched, and the Atoms of other types are skipped.
 void DHTAtomStorage::loadType(AtomTable &table, Type atom_type)
 {
-	// XXX FIXME, when working on the Atomspace, we need
-	// a longer timeout!?!!!
-	std::cout << "Start waiting for atomspace" << std::endl;
-	auto atovs = get_stuff(_atomspace_hash);
-	std::cout << "Done waiting for atomspace, got "
-	          << std::to_string(atovs.size()) << std::endl;
+	std::vector<dht::InfoHash> keys;
+	keys.reserve(NUM_TYPE_BUCKETS);
+	for (size_t bucket = 0; bucket < NUM_TYPE_BUCKETS; bucket++)
+		keys.emplace_back(get_type_index(_atomspace_name, atom_type, bucket));
 
-	for (auto ato: atovs)
+	auto atovs = get_keys(keys);
+	if (atovs.empty() and not has_type_index())
+		atovs = get_space(_atomspace_name);
+
+	// As in load_atomspace(), only the latest record for each Atom
+	// counts; an Atom that was dropped after it was added is gone.
+	std::unordered_map<dht::Value::Id, std::pair<SpaceRecord, std::string>>
+		latest;
+	for (const auto& ato: atovs)
 	{
 		std::string sname = ato->unpack<std::string>();
 
-		// See comments above.
-	   if (sname.compare(0, sizeof(ADD_ATOM)-1, ADD_ATOM))
+		SpaceRecord rec;
+		if (not parse_space_record(sname, rec)) continue;
+
+		auto it = latest.find(ato->id);
+		if (latest.end() != it and rec.stamp <= it->second.first.stamp)
 			continue;
+		latest[ato->id] = std::make_pair(rec, std::move(sname));
+	}
 
-		size_t pos = sizeof("add 1572978874.801600");
-		Handle h(Sexpr::decode_atom(sname, pos));
+	HandleSeq hseq;
+	for (auto& pr: latest)
+	{
+		const SpaceRecord& rec = pr.second.first;
+		if (not rec.add) continue;
+
+		// The dht-id is only a 64-bit hash, and so, in principle,
+		// a collision could have clobbered the index entry. The
+		// membership list holds Atoms of every type, too.
+		Handle h(decode_space_record(pr.second.second, rec));
 		if (h->get_type() != atom_type) continue;
 
-		// std::cout << "Load Atom " << sname << std::endl;
-		table.add(fetch_values(std::move(h)), false);
-		_load_count++;
+		hseq.emplace_back(h);
 	}
+
+	bloom_prefetch();
+	fetch_values_pipelined(std::move(hseq),
+		[&](const Handle& h)
+		{
+			table.add(h, false);
+			_load_count++;
+		});
 }
 
 /// Store all of the atoms in the atom table.
+///
+/// The Atoms are split up over `_store_threads` worker threads. All
+/// of the Nodes are stored first, and then all of the Links, so that
+/// readers see the leaves before the Links that hold them. Workers
+/// take Atoms in chunks, from a shared position in the list; this
+/// keeps all of them busy, even when some Atoms are slower to store
+/// than others.
 void DHTAtomStorage::storeAtomSpace(const AtomTable &table)
 {
 	logger().info("Bulk store of AtomSpace\n");
 
-	size_t cnt = 0;
+	std::atomic<size_t> cnt(0);
 	time_t bulk_start = time(0);
 
-	auto storat = [&](const Handle& h)->void
+	size_t nthreads = _store_threads;
+	std::vector<size_t> worker_cnt(nthreads, 0);
+	std::vector<double> worker_secs(nthreads, 0.0);
+	std::exception_ptr error;
+	std::mutex error_mtx;
+
+	auto store_all = [&](const HandleSeq& hseq)
 	{
-		storeAtom(h);
-		cnt++;
-		if (0 == cnt%500)
-		{
-			// Force DHT to flush pending queues every so often.
-			// Otherwise, the user perceives a hang. Worse, failure
-			// to flush often enough does TWO bad things: it wrecks
-			// performance, and also causes OpenDHT to print message
-			// "Dropped NNN packets with high delay".  Yow!!
-			// On my system, 500 seems to be the magic number.
-			barrier();
-		}
-		if (0 == cnt%1000)
+#define STORE_CHUNK 64
+		std::atomic<size_t> next(0);
+		auto worker = [&](size_t w)
 		{
-			time_t now = time(0);
-			time_t elap = now - bulk_start;
-			if (0 < elap)
+			auto start = std::chrono::steady_clock::now();
+			try
 			{
-				double rate = ((double) cnt) / elap;
-				printf("\tStored %zu atoms in %d seconds (%d per second)\n",
-				       cnt, (int) elap, (int) rate);
+				while (true)
+				{
+					size_t first = next.fetch_add(STORE_CHUNK);
+					if (hseq.size() <= first) break;
+					size_t last = std::min(first + STORE_CHUNK, hseq.size());
+					for (size_t i = first; i < last; i++)
+					{
+						// Bypass write-behind; the workers are the writers.
+						storeAtom(hseq[i], true);
+						worker_cnt[w]++;
+
+						// Do not get too far ahead of the DHT. Failure to
+						// throttle does TWO bad things: it wrecks performance,
+						// and also causes OpenDHT to print message "Dropped
+						// NNN packets with high delay".  Yow!! The window
+						// adapts to the rate at which the puts complete;
+						// see put_throttle().
+						put_throttle();
+
+						size_t n = ++cnt;
+						if (0 == n%1000)
+						{
+							time_t elap = time(0) - bulk_start;
+							if (0 < elap)
+							{
+								double rate = ((double) n) / elap;
+								printf("\tStored %zu atoms in %d seconds (%d per second)\n",
+								       n, (int) elap, (int) rate);
+							}
+						}
+					}
+				}
 			}
-		}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lck(error_mtx);
+				if (not error) error = std::current_exception();
+				next = hseq.size();
+			}
+			worker_secs[w] += std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count();
+		};
+
+		std::vector<std::thread> workers;
+		for (size_t w = 0; w < nthreads; w++)
+			workers.push_back(std::thread(worker, w));
+		for (std::thread& t : workers) t.join();
 	};
 
-	// Try to knock out the nodes first, then the links.
-	table.foreachHandleByType(storat, NODE, true);
-	table.foreachHandleByType(storat, LINK, true);
+	HandleSeq hseq;
+	auto collect = [&](const Handle& h)->void { hseq.push_back(h); };
+
+	// Knock out the nodes first, then the links.
+	table.foreachHandleByType(collect, NODE, true);
+	store_all(hseq);
+	hseq.clear();
+
+	if (not error)
+	{
+		table.foreachHandleByType(collect, LINK, true);
+		store_all(hseq);
+	}
 
 	barrier();
+	if (error) std::rethrow_exception(error);
+
+	// Small stores finish in under a second, or a tick of the clock.
 	time_t secs = time(0) - bulk_start;
-	double rate = ((double) cnt) / secs;
+	double rate = (0 < secs) ? ((double) cnt) / secs : 0.0;
 	printf("\tFinished storing %zu atoms total, in %d seconds (%d per second)\n",
-		cnt, (int) secs, (int) rate);
+		(size_t) cnt, (int) secs, (int) rate);
+	for (size_t w = 0; w < nthreads; w++)
+	{
+		rate = (0.0 < worker_secs[w]) ? worker_cnt[w] / worker_secs[w] : 0.0;
+		printf("\tWorker %zu stored %zu atoms in %f seconds (%d per second)\n",
+		       w, worker_cnt[w], worker_secs[w], (int) rate);
+	}
 }
 
 void DHTAtomStorage::loadAtomSpace(AtomTable &table)
@@ -0,0 +1,480 @@
+/*
+ * DHTCounter.cc
+ * Counters that many DHT nodes can increment at the same time.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <fstream>
+#include <iomanip>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/value/FloatValue.h>
+#include <opencog/atoms/truthvalue/CountTruthValue.h>
+#include <opencog/persist/sexpr/Sexpr.h>
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================== */
+/*
+ * Ordinary Values are last-writer-wins: the Values record on an Atom
+ * is replaced as a whole, and so two processes counting into the same
+ * Atom overwrite one-another's counts. Values kept under a counter key
+ * are instead stored as a PN-counter (a conflict-free replicated data
+ * type): every writer has its own pair of vectors, P and N, holding
+ * the sum of its own increments and decrements. These only grow, and
+ * so two states are merged by taking the larger of each entry, writer
+ * by writer. The count is the sum, over all writers, of P - N.
+ *
+ * The DHT nodes merge the states in cy_edit_values(); thus writers
+ * only need to put their own state, and never have to read first.
+ *
+ * A writer keeps track of the local count, as it was when last stored
+ * (or fetched). When storing again, the change since then is added to
+ * its own P (or N, for a decrease). A writer that never fetched the
+ * Atom thus adds its count to whatever the others have counted; it
+ * does not need to know what that is.
+ *
+ * For CountTruthValues, only the count is a counter; for FloatValues,
+ * every entry is. The counter state is the third element of the
+ * [key, value, state] entry in the Values record (see DHTValues.cc),
+ * and has the form [[writer, [P...], [N...]], ...].
+ *
+ * Each writer needs its own, stable, entry: a writer that came back
+ * with a new one would count everything over again. The writer id is
+ * thus kept in a file, one per DHT port (see writer_id()).
+ *
+ * Likewise, a writer must never lose its own entry: were it to start
+ * over from zero, the merge would keep the larger, older, entry, and
+ * the new counts would be lost. Our own entries are thus never evicted
+ * from memory, and are journaled to a file, next to the writer id (see
+ * counter_restore()). The states of the other writers are only used
+ * for working out the count that is shown locally; these are kept
+ * for the most recently used counters only.
+ *
+ * Entries in the old record, that are not in the new one, are kept
+ * by the merge; a counter thus cannot be removed by leaving it out.
+ * Instead, when a counter key is removed from an Atom, the writer
+ * puts a tombstone: a [key, nil, state] entry. This merges with the
+ * old entry like any other, but the key is removed when decoding.
+ * A later store of the key brings it back.
+ */
+
+std::atomic<size_t> DHTAtomStorage::_counter_merges(0);
+
+/// The file holding `what`, in the per-user directory, for this DHT
+/// port. Returns the empty string, if there is no home directory.
+std::string DHTAtomStorage::counter_path(const std::string& what)
+{
+	const char* home = getenv("HOME");
+	if (nullptr == home) return "";
+
+	std::string dir(std::string(home) + "/.atomspace-dht");
+	mkdir(dir.c_str(), 0700);
+	return dir + "/" + what + "-" + std::to_string(_port);
+}
+
+/**
+ * The id of our own entry in the counters. It is made up the first
+ * time, and kept in a file in the home directory, one per DHT port;
+ * thus, a restarted node continues its own entry. Two nodes running
+ * at the same time on the same machine cannot have the same port, and
+ * so never share an entry. If the file cannot be used, a fresh id is
+ * used for this session only.
+ */
+dht::InfoHash DHTAtomStorage::writer_id(void)
+{
+	std::string path(counter_path("writer"));
+	if (path.empty())
+	{
+		logger().warn("DHT counters: no HOME; using a new writer id");
+		return dht::InfoHash::getRandom();
+	}
+
+	std::ifstream ifs(path);
+	std::string hex;
+	if (ifs >> hex and 2 * dht::HASH_LEN == hex.size())
+		return dht::InfoHash(hex);
+
+	dht::InfoHash id = dht::InfoHash::getRandom();
+	std::ofstream ofs(path, std::ios::trunc);
+	ofs << id.toString() << std::endl;
+	if (not ofs)
+		logger().warn("DHT counters: cannot save the writer id in %s",
+		              path.c_str());
+	return id;
+}
+
+// The journal holds one line per change of our own entry in a counter:
+//
+//    atom-guid key-guid length P[0] ... P[length-1] N[0] ... N[length-1]
+//
+// The last line for a counter is the one that counts.
+static void journal_line(std::ostream& os,
+                         const std::pair<dht::InfoHash, dht::InfoHash>& ck,
+                         const std::vector<double>& p,
+                         const std::vector<double>& n)
+{
+	os << ck.first.toString() << " " << ck.second.toString()
+	   << " " << p.size() << std::setprecision(17);
+	for (double d : p) os << " " << d;
+	for (double d : n) os << " " << d;
+	os << std::endl;
+}
+
+/**
+ * Load our own entries in the counters of this AtomSpace from the
+ * journal, and start a fresh journal, holding only the latest entry
+ * of each counter. Without a journal, counts stored in an earlier
+ * session, under the same writer id, would be lost.
+ */
+void DHTAtomStorage::counter_restore(void)
+{
+	if (_observing_only) return;
+	std::string path(counter_path("counts"));
+	if (path.empty()) return;
+	path += "-" + _atomspace_hash.toString();
+
+	std::lock_guard<std::mutex> lck(_counter_mutex);
+	std::ifstream ifs(path);
+	std::string ahex, khex;
+	size_t len;
+	while (ifs >> ahex >> khex >> len)
+	{
+		CounterOwn own;
+		own.p.resize(len);
+		own.n.resize(len);
+		for (double& d : own.p) ifs >> d;
+		for (double& d : own.n) ifs >> d;
+		if (not ifs) break;
+
+		// Not known to be live, until stored or fetched again.
+		own.live = false;
+		_counter_own[CounterKey(dht::InfoHash(ahex), dht::InfoHash(khex))] = own;
+	}
+	ifs.close();
+
+	std::string tmp(path + ".tmp");
+	{
+		std::ofstream ofs(tmp, std::ios::trunc);
+		for (const auto& pr : _counter_own)
+			journal_line(ofs, pr.first, pr.second.p, pr.second.n);
+	}
+	if (rename(tmp.c_str(), path.c_str()))
+		logger().warn("DHT counters: cannot rewrite the journal %s",
+		              path.c_str());
+
+	_counter_log.open(path, std::ios::app);
+	if (not _counter_log)
+		logger().warn("DHT counters: cannot write to the journal %s; "
+		              "counts will be lost on restart", path.c_str());
+}
+
+/// Record the change of our own entry in the journal. The caller must
+/// hold `_counter_mutex`.
+void DHTAtomStorage::counter_journal(const CounterKey& ck,
+                                     const CounterOwn& own)
+{
+	if (not _counter_log.is_open()) return;
+	journal_line(_counter_log, ck, own.p, own.n);
+}
+
+/// Mark the key as holding counters, in all Atoms.
+void DHTAtomStorage::add_counter_key(const Handle& key)
+{
+	std::lock_guard<std::mutex> lck(_counter_mutex);
+	_counter_keys.insert(key);
+}
+
+bool DHTAtomStorage::is_counter_key(const Handle& key)
+{
+	std::lock_guard<std::mutex> lck(_counter_mutex);
+	return _counter_keys.end() != _counter_keys.find(key);
+}
+
+/// Return true if the Value can be kept as a counter.
+bool DHTAtomStorage::is_countable(const ValuePtr& v)
+{
+	Type t = v->get_type();
+	return FLOAT_VALUE == t or COUNT_TRUTH_VALUE == t;
+}
+
+/// The parts of the Value that are counted.
+static std::vector<double> counted(const ValuePtr& v)
+{
+	const std::vector<double>& fv = FloatValueCast(v)->value();
+	if (COUNT_TRUTH_VALUE == v->get_type())
+		return {fv.at(2)};
+	return fv;
+}
+
+/* ================================================================== */
+
+void DHTAtomStorage::pack_counter(msgpack::packer<msgpack::sbuffer>& pk,
+                                  const CounterState& cs)
+{
+	pk.pack_array(cs.size());
+	for (const auto& pr : cs)
+	{
+		pk.pack_array(3);
+		pk.pack(pr.first);
+		pk.pack(pr.second.first);
+		pk.pack(pr.second.second);
+	}
+}
+
+DHTAtomStorage::CounterState
+DHTAtomStorage::unpack_counter(const msgpack::object& obj)
+{
+	CounterState cs;
+	for (uint32_t i = 0; i < obj.via.array.size; i++)
+	{
+		const msgpack::object& wr = obj.via.array.ptr[i];
+		cs[wr.via.array.ptr[0].as<dht::InfoHash>()] = {
+			wr.via.array.ptr[1].as<std::vector<double>>(),
+			wr.via.array.ptr[2].as<std::vector<double>>()};
+	}
+	return cs;
+}
+
+/// Merge `from` into `into`, entry by entry.
+void DHTAtomStorage::merge_counter(CounterState& into, const CounterState& from)
+{
+	auto grow = [](std::vector<double>& a, const std::vector<double>& b)
+	{
+		if (a.size() < b.size()) a.resize(b.size(), 0.0);
+		for (size_t i = 0; i < b.size(); i++)
+			a[i] = std::max(a[i], b[i]);
+	};
+	for (const auto& pr : from)
+	{
+		auto& pn = into[pr.first];
+		grow(pn.first, pr.second.first);
+		grow(pn.second, pr.second.second);
+	}
+}
+
+/// Sum of P - N over all writers.
+std::vector<double> DHTAtomStorage::counter_total(const CounterState& cs)
+{
+	std::vector<double> tot;
+	for (const auto& pr : cs)
+	{
+		const auto& pn = pr.second;
+		if (tot.size() < pn.first.size()) tot.resize(pn.first.size(), 0.0);
+		if (tot.size() < pn.second.size()) tot.resize(pn.second.size(), 0.0);
+		for (size_t i = 0; i < pn.first.size(); i++) tot[i] += pn.first[i];
+		for (size_t i = 0; i < pn.second.size(); i++) tot[i] -= pn.second[i];
+	}
+	return tot;
+}
+
+/* ================================================================== */
+
+/// Add the change of the local count, since it was last stored or
+/// fetched, to our own entry, and return the counter state to store.
+DHTAtomStorage::CounterState
+DHTAtomStorage::count_local(const Handle& atom, const Handle& key,
+                            const ValuePtr& v)
+{
+	std::vector<double> local(counted(v));
+	CounterKey ck(get_guid(atom), get_guid(key));
+
+	std::lock_guard<std::mutex> lck(_counter_mutex);
+	CounterOwn& own = _counter_own[ck];
+	if (own.p.size() < local.size()) own.p.resize(local.size(), 0.0);
+	if (own.n.size() < local.size()) own.n.resize(local.size(), 0.0);
+	own.base.resize(local.size(), 0.0);
+
+	bool changed = false;
+	for (size_t i = 0; i < local.size(); i++)
+	{
+		double delta = local[i] - own.base[i];
+		if (0.0 < delta) own.p[i] += delta;
+		else if (delta < 0.0) own.n[i] -= delta;
+		else continue;
+		own.base[i] = local[i];
+		changed = true;
+	}
+	own.live = true;
+	if (changed) counter_journal(ck, own);
+
+	CounterState* found = _counters.find(ck);
+	CounterState cs(found ? *found : CounterState());
+	cs[_counter_id] = {own.p, own.n};
+	_counters.put(ck, cs);
+	return cs;
+}
+
+/// The counters that were removed from the Atom since they were last
+/// stored or fetched, with their last known states. These are stored
+/// as tombstones, once. Our own entries are kept; they continue from
+/// where they were, if the counter is stored again.
+DHTAtomStorage::CounterTombs
+DHTAtomStorage::counter_tombstones(const Handle& atom)
+{
+	CounterTombs dead;
+	dht::InfoHash aguid = get_guid(atom);
+
+	HandleSeq keys;
+	{
+		std::lock_guard<std::mutex> lck(_counter_mutex);
+		keys.assign(_counter_keys.begin(), _counter_keys.end());
+	}
+	for (const Handle& key : keys)
+	{
+		if (atom->getValue(key)) continue;
+		CounterKey ck(aguid, get_guid(key));
+
+		std::lock_guard<std::mutex> lck(_counter_mutex);
+		auto it = _counter_own.find(ck);
+		if (_counter_own.end() == it or not it->second.live) continue;
+		CounterOwn& own = it->second;
+
+		CounterState* found = _counters.find(ck);
+		CounterState cs(found ? *found : CounterState());
+		merge_counter(cs, {{_counter_id, {own.p, own.n}}});
+		dead.emplace_back(key, cs);
+
+		own.live = false;
+		own.base.clear();
+		_counters.erase(ck);
+	}
+	return dead;
+}
+
+/// Merge the counter state that was fetched, and return the Value,
+/// with the counted parts replaced by the merged count. This count is
+/// what later changes of the local count are measured from.
+ValuePtr DHTAtomStorage::count_remote(const Handle& atom, const Handle& key,
+                                      const ValuePtr& v, const CounterState& got)
+{
+	CounterKey ck(get_guid(atom), get_guid(key));
+
+	std::lock_guard<std::mutex> lck(_counter_mutex);
+	_counter_keys.insert(key);
+	CounterState* found = _counters.find(ck);
+	CounterState cs(found ? *found : CounterState());
+	merge_counter(cs, got);
+
+	// Our own entry, as we know it, may be ahead of what was fetched;
+	// and, should the journal have been lost, behind it.
+	CounterOwn& own = _counter_own[ck];
+	merge_counter(cs, {{_counter_id, {own.p, own.n}}});
+	const auto& mine = cs[_counter_id];
+	if (own.p != mine.first or own.n != mine.second)
+	{
+		own.p = mine.first;
+		own.n = mine.second;
+		counter_journal(ck, own);
+	}
+	own.live = true;
+	_counters.put(ck, cs);
+
+	if (not is_countable(v)) return v;
+	std::vector<double> tot(counter_total(cs));
+	std::vector<double> fv(FloatValueCast(v)->value());
+	ValuePtr merged;
+	if (COUNT_TRUTH_VALUE == v->get_type())
+		merged = CountTruthValue::createTV(fv.at(0), fv.at(1),
+		                                   tot.empty() ? 0.0 : tot[0]);
+	else
+	{
+		tot.resize(fv.size(), 0.0);
+		merged = createFloatValue(tot);
+	}
+	own.base = counted(merged);
+	return merged;
+}
+
+/* ================================================================== */
+
+/**
+ * Merge the counter states in the old Values record into the new one.
+ * This runs on the DHT nodes holding the record, and so it does not
+ * decode the Values themselves; only the counter states are merged.
+ * Readers work out the counts from the states. Counter entries that
+ * are in the old record, but not in the new one, are kept; a writer
+ * that did not know about a counter should not wipe it out. The value
+ * of a merged entry is that of the new record; thus, a tombstone
+ * replaces a live counter, and a live counter replaces a tombstone.
+ * Returns false, if there was nothing to merge.
+ */
+bool DHTAtomStorage::merge_counters(const dht::Blob& old_blob,
+                                    dht::Blob& new_blob)
+{
+	msgpack::object_handle ooh = msgpack::unpack(
+		(const char*) old_blob.data(), old_blob.size());
+	msgpack::object_handle noh = msgpack::unpack(
+		(const char*) new_blob.data(), new_blob.size());
+	const msgpack::object& orec = ooh.get();
+	const msgpack::object& nrec = noh.get();
+
+	// Deletions and older records are not merged.
+	auto entries = [](const msgpack::object& rec)
+		-> std::map<std::string, const msgpack::object*>
+	{
+		std::map<std::string, const msgpack::object*> ents;
+		if (msgpack::type::ARRAY != rec.type or 2 != rec.via.array.size)
+			return ents;
+		const msgpack::object& alist = rec.via.array.ptr[1];
+		for (uint32_t i = 0; i < alist.via.array.size; i++)
+		{
+			const msgpack::object& ent = alist.via.array.ptr[i];
+			if (3 == ent.via.array.size)
+				ents[ent.via.array.ptr[0].as<std::string>()] = &ent;
+		}
+		return ents;
+	};
+	auto ocnt = entries(orec);
+	if (ocnt.empty()) return false;
+	if (msgpack::type::ARRAY != nrec.type or 2 != nrec.via.array.size)
+		return false;
+	auto ncnt = entries(nrec);
+
+	const msgpack::object& nlist = nrec.via.array.ptr[1];
+	size_t nkept = 0;
+	for (const auto& pr : ocnt)
+		if (ncnt.end() == ncnt.find(pr.first)) nkept++;
+
+	msgpack::sbuffer buf;
+	msgpack::packer<msgpack::sbuffer> pk(&buf);
+	pk.pack_array(2);
+	pk.pack(nrec.via.array.ptr[0]);
+	pk.pack_array(nlist.via.array.size + nkept);
+	for (uint32_t i = 0; i < nlist.via.array.size; i++)
+	{
+		const msgpack::object& ent = nlist.via.array.ptr[i];
+		if (3 != ent.via.array.size)
+		{
+			pk.pack(ent);
+			continue;
+		}
+		auto it = ocnt.find(ent.via.array.ptr[0].as<std::string>());
+		if (ocnt.end() == it)
+		{
+			pk.pack(ent);
+			continue;
+		}
+		CounterState cs(unpack_counter(ent.via.array.ptr[2]));
+		merge_counter(cs, unpack_counter(it->second->via.array.ptr[2]));
+		pk.pack_array(3);
+		pk.pack(ent.via.array.ptr[0]);
+		pk.pack(ent.via.array.ptr[1]);
+		pack_counter(pk, cs);
+	}
+	for (const auto& pr : ocnt)
+		if (ncnt.end() == ncnt.find(pr.first)) pk.pack(*pr.second);
+
+	new_blob.assign(buf.data(), buf.data() + buf.size());
+	_counter_merges++;
+	return true;
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,205 @@
+/*
+ * DHTDiskCache.cc
+ * Local on-disk cache of DHT records.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <functional>
+
+#include <opencog/util/exceptions.h>
+
+#include "DHTDiskCache.h"
+
+using namespace opencog;
+
+/* ================================================================== */
+// File format: a header, followed by records. Each record is
+//
+//    uint32_t  length of the packed value (native byte order)
+//    20 bytes  the DHT key
+//    length    the dht::Value, as packed by dht::Value::getPacked()
+
+#define DISK_CACHE_MAGIC "OpenCog DHT records v1\n"
+#define MAGIC_LEN (sizeof(DISK_CACHE_MAGIC) - 1)
+#define RECORD_HEAD (sizeof(uint32_t) + dht::HASH_LEN)
+
+static size_t digest(const uint8_t* data, size_t len)
+{
+	return std::hash<std::string>()(std::string((const char*) data, len));
+}
+
+DHTDiskCache::DHTDiskCache(const std::string& path) :
+	_path(path), hits(0), misses(0), writes(0), duplicates(0)
+{
+	_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (_fd < 0)
+		throw IOException(TRACE_INFO, "Cannot open DHT disk cache %s: %s",
+			path.c_str(), strerror(errno));
+
+	try { replay(); }
+	catch (...)
+	{
+		close(_fd);
+		throw;
+	}
+}
+
+DHTDiskCache::~DHTDiskCache()
+{
+	fsync(_fd);
+	close(_fd);
+}
+
+/// Read the log, and build the index. A short record at the end is
+/// left over from a crash; it is cut off.
+void DHTDiskCache::replay(void)
+{
+	off_t fsize = lseek(_fd, 0, SEEK_END);
+	if (0 == fsize)
+	{
+		if ((ssize_t) MAGIC_LEN != pwrite(_fd, DISK_CACHE_MAGIC, MAGIC_LEN, 0))
+			throw IOException(TRACE_INFO, "Cannot write DHT disk cache %s",
+				_path.c_str());
+		_end = MAGIC_LEN;
+		return;
+	}
+
+	char magic[MAGIC_LEN];
+	if ((ssize_t) MAGIC_LEN != pread(_fd, magic, MAGIC_LEN, 0) or
+	    memcmp(magic, DISK_CACHE_MAGIC, MAGIC_LEN))
+		throw IOException(TRACE_INFO, "Not a DHT disk cache: %s",
+			_path.c_str());
+
+	off_t off = MAGIC_LEN;
+	std::vector<uint8_t> buf;
+	while (off + (off_t) RECORD_HEAD <= fsize)
+	{
+		uint8_t head[RECORD_HEAD];
+		if ((ssize_t) RECORD_HEAD != pread(_fd, head, RECORD_HEAD, off)) break;
+
+		uint32_t length;
+		memcpy(&length, head, sizeof(length));
+		off_t voff = off + RECORD_HEAD;
+		if (fsize < voff + (off_t) length) break;
+
+		buf.resize(length);
+		if ((ssize_t) length != pread(_fd, buf.data(), length, voff)) break;
+
+		dht::InfoHash key(head + sizeof(uint32_t), dht::HASH_LEN);
+		try
+		{
+			msgpack::object_handle oh =
+				msgpack::unpack((const char*) buf.data(), length);
+			dht::Value val(oh.get());
+			_index[key][val.id] = {voff, length, digest(buf.data(), length)};
+		}
+		catch (const std::exception& ex)
+		{
+			break;
+		}
+		off = voff + length;
+	}
+
+	if (off < fsize and 0 != ftruncate(_fd, off))
+		throw IOException(TRACE_INFO, "Cannot truncate DHT disk cache %s",
+			_path.c_str());
+	_end = off;
+}
+
+/// Add a record, unless an identical one is already there.
+void DHTDiskCache::put(const dht::InfoHash& key, const dht::Value& val)
+{
+	dht::Blob packed = val.getPacked();
+	size_t dig = digest(packed.data(), packed.size());
+
+	uint32_t length = packed.size();
+	std::vector<uint8_t> rec(RECORD_HEAD + length);
+	memcpy(rec.data(), &length, sizeof(length));
+	memcpy(rec.data() + sizeof(length), key.data(), dht::HASH_LEN);
+	memcpy(rec.data() + RECORD_HEAD, packed.data(), length);
+
+	std::lock_guard<std::mutex> lck(_mtx);
+	auto& slots = _index[key];
+	auto it = slots.find(val.id);
+	if (slots.end() != it and it->second.length == length and
+	    it->second.digest == dig)
+	{
+		duplicates++;
+		return;
+	}
+
+	if ((ssize_t) rec.size() != pwrite(_fd, rec.data(), rec.size(), _end))
+		throw IOException(TRACE_INFO, "Cannot write DHT disk cache %s: %s",
+			_path.c_str(), strerror(errno));
+
+	slots[val.id] = {_end + (off_t) RECORD_HEAD, length, dig};
+	_end += rec.size();
+	writes++;
+}
+
+std::shared_ptr<dht::Value> DHTDiskCache::read_slot(const Slot& slot)
+{
+	std::vector<uint8_t> buf(slot.length);
+	if ((ssize_t) slot.length != pread(_fd, buf.data(), slot.length, slot.offset))
+		throw IOException(TRACE_INFO, "Cannot read DHT disk cache %s",
+			_path.c_str());
+
+	msgpack::object_handle oh =
+		msgpack::unpack((const char*) buf.data(), slot.length);
+	return std::make_shared<dht::Value>(oh.get());
+}
+
+/// Return all of the records on the key that pass the filter.
+std::vector<std::shared_ptr<dht::Value>>
+DHTDiskCache::get(const dht::InfoHash& key, const dht::Value::Filter& filter)
+{
+	std::vector<std::shared_ptr<dht::Value>> vals;
+
+	std::lock_guard<std::mutex> lck(_mtx);
+	auto it = _index.find(key);
+	if (_index.end() != it)
+	{
+		for (const auto& pr : it->second)
+		{
+			std::shared_ptr<dht::Value> val(read_slot(pr.second));
+			if (not filter or filter(*val))
+				vals.emplace_back(val);
+		}
+	}
+
+	if (vals.empty()) misses++; else hits++;
+	return vals;
+}
+
+/// Return all of the keys that have records.
+std::vector<dht::InfoHash> DHTDiskCache::keys(void)
+{
+	std::vector<dht::InfoHash> ks;
+	std::lock_guard<std::mutex> lck(_mtx);
+	for (const auto& pr : _index)
+		ks.push_back(pr.first);
+	return ks;
+}
+
+size_t DHTDiskCache::size(void)
+{
+	size_t cnt = 0;
+	std::lock_guard<std::mutex> lck(_mtx);
+	for (const auto& pr : _index)
+		cnt += pr.second.size();
+	return cnt;
+}
+
+/// Push everything written so far out to the disk.
+void DHTDiskCache::flush(void)
+{
+	fsync(_fd);
+}
+
+/* ============================= END OF FILE ================= */
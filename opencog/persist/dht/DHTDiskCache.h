@@ -0,0 +1,93 @@
+/*
+ * FILE:
+ * opencog/persist/dht/DHTDiskCache.h
+ *
+ * FUNCTION:
+ * Local on-disk cache of DHT records.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_DHT_DISK_CACHE_H
+#define _OPENCOG_DHT_DISK_CACHE_H
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opendht.h>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/**
+ * A key-value store of DHT records, kept in a local file. The file is
+ * an append-only log; each record is the DHT key, followed by the
+ * packed dht::Value. Just as in the DHT itself, a later record with
+ * the same key and the same Value::id replaces the earlier one. The
+ * in-RAM index holds only the file offsets of the live records; the
+ * records themselves are read from disk when asked for.
+ *
+ * A record that was cut short (by a crash, say) at the end of the
+ * file is discarded when the file is opened. Superseded records are
+ * never removed; the log only grows.
+ *
+ * This class is thread-safe.
+ */
+class DHTDiskCache
+{
+	private:
+		std::string _path;
+		int _fd;
+		off_t _end;
+
+		struct Slot
+		{
+			off_t offset;     // start of the packed value
+			uint32_t length;  // size of the packed value
+			size_t digest;    // hash of the packed value
+		};
+		std::mutex _mtx;
+		std::map<dht::InfoHash, std::map<dht::Value::Id, Slot>> _index;
+
+		void replay(void);
+		std::shared_ptr<dht::Value> read_slot(const Slot&);
+
+	public:
+		DHTDiskCache(const std::string& path);
+		DHTDiskCache(const DHTDiskCache&) = delete;
+		DHTDiskCache& operator=(const DHTDiskCache&) = delete;
+		~DHTDiskCache();
+
+		void put(const dht::InfoHash&, const dht::Value&);
+		std::vector<std::shared_ptr<dht::Value>>
+		get(const dht::InfoHash&, const dht::Value::Filter& = {});
+		std::vector<dht::InfoHash> keys(void);
+		void flush(void);
+
+		const std::string& path(void) const { return _path; }
+		size_t size(void);
+
+		// Statistics
+		std::atomic<size_t> hits;
+		std::atomic<size_t> misses;
+		std::atomic<size_t> writes;
+		std::atomic<size_t> duplicates;
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_DHT_DISK_CACHE_H
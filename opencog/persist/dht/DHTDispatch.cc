@@ -0,0 +1,755 @@
+/*
+ * DHTDispatch.cc
+ * Synchronous and asynchronous fetching of DHT values, and flow
+ * control for storing them.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <algorithm>
+#include <cmath>
+
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================== */
+// Timeouts for gets.
+//
+// A single lost UDP reply can stall an OpenDHT get for a long time.
+// Thus, the round-trip time of gets is measured (separately for each
+// class of keys), and a get that takes longer than most is hedged: a
+// second, identical get is issued, and whichever finishes first wins.
+// A get that does not finish within the retransmission timeout (RTO)
+// is issued once more, with the timeout doubled, as in TCP. As in
+// TCP (Karn's algorithm), the doubled timeout is kept for later gets,
+// until a get completes in time again.
+//
+// The timeouts only say when to try again, not when to give up: all
+// of the tries, together, are given at least the configured wait time.
+// A get of a key that no node has looked up lately may need several
+// hops, and so take far longer than the gets that were measured.
+
+#define INITIAL_RTO 1000.0  // msecs, before anything was measured
+#define MIN_RTO 200.0       // msecs
+#define MAX_GET_TRIES 3
+
+// Number of recent round-trip times kept, and the percentile of these,
+// after which a get is hedged. Until there are enough samples, gets
+// are hedged at half of the timeout.
+#define RTT_HISTORY 128
+#define MIN_HEDGE_SAMPLES 16
+#define HEDGE_PERCENTILE 0.95
+
+const char* DHTAtomStorage::key_class_name(KeyClass kc)
+{
+	switch (kc)
+	{
+		case ATOM_KEYS: return "atoms";
+		case VALUE_KEYS: return "values";
+		case SET_KEYS: return "sets";
+		case SPACE_KEYS: return "space";
+		default: return "other";
+	}
+}
+
+/// Record the round-trip time of a completed get.
+void DHTAtomStorage::rtt_sample(KeyClass kc, double msecs)
+{
+	std::lock_guard<std::mutex> lck(_rtt_mutex);
+	RttEstimator& est = _rtt[kc];
+	if (0 == est.samples)
+	{
+		est.srtt = msecs;
+		est.rttvar = msecs / 2.0;
+	}
+	else
+	{
+		est.rttvar = 0.75 * est.rttvar + 0.25 * std::abs(est.srtt - msecs);
+		est.srtt = 0.875 * est.srtt + 0.125 * msecs;
+	}
+	est.backoff = 0.0;
+	if (est.recent.size() < RTT_HISTORY)
+		est.recent.push_back(msecs);
+	else
+		est.recent[est.samples % RTT_HISTORY] = msecs;
+	est.samples++;
+}
+
+/// Return the timeout, and the delay before hedging, in msecs.
+void DHTAtomStorage::rtt_timers(KeyClass kc, double& rto, double& hedge)
+{
+	double max_rto =
+		std::chrono::duration<double, std::milli>(_wait_time).count();
+
+	std::lock_guard<std::mutex> lck(_rtt_mutex);
+	const RttEstimator& est = _rtt[kc];
+	rto = INITIAL_RTO;
+	if (0 < est.samples)
+		rto = est.srtt + 4.0 * est.rttvar;
+	rto = std::max(rto, est.backoff);
+	rto = std::min(std::max(rto, MIN_RTO), max_rto);
+
+	hedge = rto / 2.0;
+	if (MIN_HEDGE_SAMPLES <= est.recent.size())
+	{
+		std::vector<double> sorted(est.recent);
+		size_t nth = HEDGE_PERCENTILE * (sorted.size() - 1);
+		std::nth_element(sorted.begin(), sorted.begin() + nth, sorted.end());
+		hedge = std::min(sorted[nth], rto);
+	}
+}
+
+/// Count a retry. The timeout that was backed off to, if any, is kept
+/// for the later gets, until a fresh round-trip time is measured.
+void DHTAtomStorage::rtt_backoff(KeyClass kc, double rto)
+{
+	std::lock_guard<std::mutex> lck(_rtt_mutex);
+	RttEstimator& est = _rtt[kc];
+	est.backoff = std::max(est.backoff, rto);
+	est.retries++;
+}
+
+void DHTAtomStorage::issue_get(const std::shared_ptr<GetCall>& call,
+                               const dht::InfoHash& ihash,
+                               const dht::Value::Filter& filter,
+                               KeyClass kc)
+{
+	size_t i;
+	{
+		std::lock_guard<std::mutex> lck(call->mtx);
+		i = call->vals.size();
+		call->vals.emplace_back();
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	_runner.get(ihash,
+		[call, i](const ValueSeq& got)->bool
+		{
+			std::lock_guard<std::mutex> lck(call->mtx);
+			ValueSeq& vals = call->vals[i];
+			vals.insert(vals.end(), got.begin(), got.end());
+			return true;
+		},
+		[this, call, i, kc, start]
+		(bool ok, const std::vector<std::shared_ptr<dht::Node>>&)
+		{
+			if (ok)
+				rtt_sample(kc, std::chrono::duration<double, std::milli>(
+					std::chrono::steady_clock::now() - start).count());
+
+			std::lock_guard<std::mutex> lck(call->mtx);
+			if (not ok) call->failed++;
+			else if (call->winner < 0) call->winner = i;
+			call->cv.notify_all();
+		},
+		filter);
+}
+
+/**
+ * Get all of the values attached to the key, and wait for them to
+ * arrive. If the get is slow, it is hedged; if it takes longer than
+ * the timeout, or if it fails, it is tried again. Throws, if none of
+ * the tries succeeded within the wait time (or, sooner, if all of
+ * them failed).
+ *
+ * The callbacks run on the DHT runner thread; they only gather up the
+ * values and signal completion. Thus, this is safe to call from the
+ * dispatcher threads, but NOT from within a DHT callback.
+ */
+std::vector<std::shared_ptr<dht::Value>>
+DHTAtomStorage::get_stuff(const dht::InfoHash& ihash,
+                          const dht::Value::Filter& filter,
+                          KeyClass kc)
+{
+	auto call = std::make_shared<GetCall>();
+	issue_get(call, ihash, filter, kc);
+	return get_wait(call, ihash, filter, kc);
+}
+
+/**
+ * Wait for the get that was issued for the call, hedging it and
+ * trying it again as needed; see get_stuff(). The timers count from
+ * the start of the call, and so many calls can be started at once,
+ * and then waited on one after the other.
+ */
+std::vector<std::shared_ptr<dht::Value>>
+DHTAtomStorage::get_wait(const std::shared_ptr<GetCall>& call,
+                         const dht::InfoHash& ihash,
+                         const dht::Value::Filter& filter,
+                         KeyClass kc)
+{
+	using msecs = std::chrono::duration<double, std::milli>;
+	using clock = std::chrono::steady_clock;
+
+	double rto, hedge;
+	rtt_timers(kc, rto, hedge);
+	double max_rto = msecs(_wait_time).count();
+	auto deadline = call->start + _wait_time;
+	auto after = [&call](double ms)
+		{ return call->start + std::chrono::duration_cast<clock::duration>(msecs(ms)); };
+
+	// Finished, when one get succeeded, or when all of them failed.
+	auto done = [&call]
+		{ return 0 <= call->winner or call->vals.size() == call->failed; };
+
+	std::unique_lock<std::mutex> lck(call->mtx);
+	if (call->cv.wait_until(lck, after(hedge), done) and 0 <= call->winner)
+		return std::move(call->vals[call->winner]);
+
+	lck.unlock();
+	issue_get(call, ihash, filter, kc);
+	lck.lock();
+	{
+		std::lock_guard<std::mutex> rlck(_rtt_mutex);
+		_rtt[kc].hedges++;
+	}
+
+	// When the current try is given up on, in msecs from the start.
+	double until = rto;
+	for (int attempt = 0; attempt < MAX_GET_TRIES; attempt++)
+	{
+		// The last try takes whatever is left of the wait time.
+		auto limit = after(until);
+		if (attempt + 1 == MAX_GET_TRIES)
+			limit = std::max(limit, deadline);
+
+		bool timed_out = not call->cv.wait_until(lck, limit, done);
+		if (0 <= call->winner)
+		{
+			// Won by the hedge, or by a retry, of a slow first get.
+			if (0 != call->winner)
+			{
+				std::lock_guard<std::mutex> rlck(_rtt_mutex);
+				_rtt[kc].hedge_wins++;
+			}
+			return std::move(call->vals[call->winner]);
+		}
+
+		// Back off, and try again. A get that failed is tried again
+		// at once; that is not a sign of a slow network.
+		if (attempt + 1 < MAX_GET_TRIES)
+		{
+			if (timed_out) rto = std::min(2.0 * rto, max_rto);
+			lck.unlock();
+			rtt_backoff(kc, timed_out ? rto : 0.0);
+			issue_get(call, ihash, filter, kc);
+			lck.lock();
+			until = msecs(clock::now() - call->start).count() + rto;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> rlck(_rtt_mutex);
+		_rtt[kc].timeouts++;
+	}
+	throw IOException(TRACE_INFO, "DHT is not responding!");
+}
+
+/* ================================================================== */
+
+/**
+ * Get all of the values attached to the key, without waiting. When
+ * the get completes, the `reply` is called on one of the dispatcher
+ * threads, with all of the values that were found.
+ *
+ * If `ifl` is not null, then the request is counted as being in
+ * flight, until after the `reply` has returned. Any exception thrown
+ * by the `reply` is recorded there, and is rethrown by inflight_drain().
+ * A get that fails, or that is dropped during shutdown, is recorded
+ * there as an error, too; the `reply` is not called for it. If there
+ * is an `on_fail`, then that is run instead, for a get that fails,
+ * the same way as the `reply` would have been.
+ */
+void DHTAtomStorage::get_async(const dht::InfoHash& ihash, GetReply reply,
+                               const dht::Value::Filter& filter,
+                               InFlight* ifl,
+                               std::function<void(void)> on_fail)
+{
+	std::shared_ptr<InFlight::Ref> ref;
+	if (ifl)
+	{
+		std::lock_guard<std::mutex> lck(ifl->mtx);
+		ifl->busy++;
+		ref = ifl->ref;
+	}
+
+	// Only the DHT runner thread touches `vals`, until it is handed
+	// over to the dispatcher.
+	auto vals = std::make_shared<ValueSeq>();
+	_runner.get(ihash,
+		[vals](const ValueSeq& got)->bool
+		{
+			vals->insert(vals->end(), got.begin(), got.end());
+			return true;
+		},
+		[this, vals, reply, on_fail, ref]
+		(bool ok, const std::vector<std::shared_ptr<dht::Node>>&)
+		{
+			// The values that did arrive are not all there is.
+			if (not ok and not on_fail)
+			{
+				inflight_done(ref, std::make_exception_ptr(
+					IOException(TRACE_INFO, "DHT is not responding!")));
+				return;
+			}
+
+			bool queued = dispatch([vals, reply, on_fail, ok, ref](void)
+			{
+				if (not inflight_enter(ref)) return;
+
+				std::exception_ptr error;
+				try
+				{
+					if (ok) reply(std::move(*vals));
+					else on_fail();
+				}
+				catch (...) { error = std::current_exception(); }
+				inflight_done(ref, error, true);
+			});
+
+			// Shutting down; the reply will never run.
+			if (not queued)
+				inflight_done(ref, std::make_exception_ptr(
+					IOException(TRACE_INFO, "DHT node is shutting down!")));
+		},
+		filter);
+}
+
+/// A reply handler is about to run. Returns false if the request was
+/// given up on; the handler must then not run.
+bool DHTAtomStorage::inflight_enter(const std::shared_ptr<InFlight::Ref>& ref)
+{
+	if (nullptr == ref) return true;
+
+	std::lock_guard<std::mutex> rlck(ref->mtx);
+	if (nullptr == ref->ifl) return false;
+	ref->running++;
+	return true;
+}
+
+/// An asynchronous request is no longer in flight. Record the error,
+/// if there was one, unless it was already given up on. If `entered`,
+/// then its reply handler has finished running.
+void DHTAtomStorage::inflight_done(const std::shared_ptr<InFlight::Ref>& ref,
+                                   std::exception_ptr error, bool entered)
+{
+	if (nullptr == ref)
+	{
+		if (error) logger().warn("DHT reply handler failed");
+		return;
+	}
+
+	std::lock_guard<std::mutex> rlck(ref->mtx);
+	InFlight* ifl = ref->ifl;
+	if (ifl)
+	{
+		std::lock_guard<std::mutex> lck(ifl->mtx);
+		if (error and not ifl->error) ifl->error = error;
+		ifl->busy--;
+		ifl->done++;
+		ifl->cv.notify_all();
+	}
+	if (entered)
+	{
+		ref->running--;
+		ref->cv.notify_all();
+	}
+}
+
+// A wait for requests in flight gives up, if none of them have
+// finished for this many times the DHT wait time.
+#define INFLIGHT_STALL 4
+
+/**
+ * Wait until no more than `level` requests are in flight. Throws, if
+ * none of the requests finish for a long time; the DHT is then not
+ * answering.
+ *
+ * The waiting thread helps out, by running reply handlers from the
+ * dispatch queue. This avoids a deadlock when a reply handler itself
+ * waits on requests, and all of the dispatcher threads are busy doing
+ * the same.
+ */
+void DHTAtomStorage::inflight_wait(InFlight& ifl, size_t level)
+{
+	auto stall = INFLIGHT_STALL * _wait_time;
+	auto deadline = std::chrono::steady_clock::now() + stall;
+
+	std::unique_lock<std::mutex> lck(ifl.mtx);
+	size_t done = ifl.done;
+	while (level < ifl.busy)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (done != ifl.done)
+		{
+			done = ifl.done;
+			deadline = now + stall;
+		}
+		else if (deadline < now)
+			throw IOException(TRACE_INFO, "DHT is not responding!");
+
+		lck.unlock();
+		std::function<void(void)> task;
+		if (_dispatch_queue.try_get(task))
+		{
+			task();
+			lck.lock();
+			continue;
+		}
+		lck.lock();
+		ifl.cv.wait_for(lck, std::chrono::milliseconds(10),
+		                [&ifl, level]{ return ifl.busy <= level; });
+	}
+}
+
+/// Wait for all requests to complete, and rethrow the first error,
+/// if there was one.
+void DHTAtomStorage::inflight_drain(InFlight& ifl)
+{
+	inflight_wait(ifl, 0);
+	if (ifl.error) std::rethrow_exception(ifl.error);
+}
+
+/* ================================================================== */
+// Flow control for puts.
+//
+// OpenDHT queues up puts without limit; if they are issued faster
+// than the network can carry them, then it starts dropping packets
+// ("Dropped NNN packets with high delay"). Thus, the number of puts
+// in flight is measured, and bulk stores are throttled to a window.
+// The window is adjusted AIMD-style: it grows by about one put per
+// round-trip while puts complete promptly, and is halved when they
+// fail, or take much longer than the fastest ones seen.
+
+#define MIN_PUT_WINDOW 8
+#define MAX_PUT_WINDOW 16384
+
+// A put is "slow" if it takes this many times longer than the
+// fastest one seen recently. Only the puts of the last one or two
+// PUT_MIN_WINDOW msecs count; a single lucky put, long ago, or on a
+// network path that has since changed, does not make all of the
+// later ones look slow.
+#define SLOW_PUT_FACTOR 4.0
+#define PUT_MIN_WINDOW 10000
+
+// A put that fails is tried again, up to MAX_PUT_TRIES times in all,
+// waiting PUT_RETRY_DELAY msecs before the first retry, and twice as
+// long before each one after that. At most MAX_RESEND_QUEUE puts wait
+// to be sent again; failures beyond that are given up on at once, as
+// the network is in no shape to take more.
+//
+// A put replaces whatever value with the same id is on the key; the
+// DHT nodes do not check which one is newer. Thus, a failed put that
+// is sent again, after a later put to the same key and id, would undo
+// the later one: an Atom that was dropped would come back, or older
+// Values would replace newer ones. So, a failed put is given up on,
+// as soon as a later put to the same key and id is issued.
+#define MAX_PUT_TRIES 5
+#define PUT_RETRY_DELAY 250
+#define MAX_RESEND_QUEUE 16384
+
+/// Put the value on the key, counting it as in flight until the DHT
+/// says that it is done.
+void DHTAtomStorage::put_stuff(const dht::InfoHash& ihash, dht::Value&& val)
+{
+	// First, as this may throw; the put is then not in flight.
+	auto disk = disk_cache();
+	if (disk) disk->put(ihash, val);
+
+	{
+		std::lock_guard<std::mutex> lck(_puts.mtx);
+		_puts.busy++;
+	}
+	_num_puts++;
+
+	PendingPut pp{ihash, std::make_shared<dht::Value>(std::move(val)), 0, 0};
+	put_latest(pp);
+	send_put(std::move(pp));
+}
+
+/// Make the put the latest one to its slot. An earlier put to the
+/// slot, that failed and is waiting to be sent again, is given up on.
+void DHTAtomStorage::put_latest(PendingPut& pp)
+{
+	PutSlot slot(pp.key, pp.val->id);
+	bool superseded = false;
+	{
+		std::lock_guard<std::mutex> lck(_resend_mutex);
+		pp.seq = ++_put_seq;
+		_put_latest[slot] = pp.seq;
+		auto it = _resend_slots.find(slot);
+		if (_resend_slots.end() != it)
+		{
+			_resend_queue.erase(it->second);
+			_resend_slots.erase(it);
+			superseded = true;
+		}
+	}
+	if (not superseded) return;
+	_num_put_superseded++;
+	put_finished();
+}
+
+/// The put is done with, for good. Unless a later put was issued to
+/// its slot, the slot is forgotten. The caller must hold `_resend_mutex`.
+void DHTAtomStorage::put_retire(const PendingPut& pp)
+{
+	auto it = _put_latest.find(PutSlot(pp.key, pp.val->id));
+	if (_put_latest.end() != it and it->second == pp.seq)
+		_put_latest.erase(it);
+}
+
+void DHTAtomStorage::send_put(PendingPut&& pp)
+{
+	// Copy the key; the lambda capture below moves `pp` away.
+	dht::InfoHash key(pp.key);
+	std::shared_ptr<dht::Value> val(pp.val);
+	auto start = std::chrono::steady_clock::now();
+	auto pending = std::make_shared<PendingPut>(std::move(pp));
+	_runner.put(key, val,
+		[this, start, pending]
+		(bool ok, const std::vector<std::shared_ptr<dht::Node>>&)
+		{
+			put_done(ok, std::chrono::steady_clock::now() - start,
+			         std::move(*pending));
+		});
+}
+
+/// Called on the DHT runner thread, when a put completes.
+void DHTAtomStorage::put_done(bool ok, std::chrono::steady_clock::duration dt,
+                              PendingPut&& pp)
+{
+	double msecs =
+		std::chrono::duration<double, std::milli>(dt).count();
+	auto now = std::chrono::steady_clock::now();
+
+	{
+		std::lock_guard<std::mutex> lck(_puts.mtx);
+		if (0.0 == _put_srtt) _put_srtt = msecs;
+		_put_srtt = 0.875 * _put_srtt + 0.125 * msecs;
+
+		// Windowed minimum: start a fresh window every PUT_MIN_WINDOW,
+		// keeping the previous one, so that the minimum never covers
+		// less than one whole window.
+		if (_put_min_start + std::chrono::milliseconds(PUT_MIN_WINDOW) < now)
+		{
+			_put_min_prev = _put_min_rtt;
+			_put_min_rtt = 0.0;
+			_put_min_start = now;
+		}
+		if (0.0 == _put_min_rtt or msecs < _put_min_rtt) _put_min_rtt = msecs;
+
+		// Multiplicative decrease, at most once per round-trip, as all
+		// of the puts of one round-trip see the same congestion.
+		if (not ok or SLOW_PUT_FACTOR * put_min_rtt() < msecs)
+		{
+			std::chrono::duration<double, std::milli> rtt(_put_srtt);
+			if (_put_last_cut + rtt < now)
+			{
+				_put_window = std::max(_put_window / 2.0, (double) MIN_PUT_WINDOW);
+				_put_last_cut = now;
+			}
+		}
+		else
+		{
+			// Additive increase: about one more put per window.
+			_put_window = std::min(_put_window + 1.0 / _put_window,
+			                       (double) MAX_PUT_WINDOW);
+		}
+	}
+
+	if (ok)
+	{
+		{
+			std::lock_guard<std::mutex> lck(_resend_mutex);
+			put_retire(pp);
+		}
+		put_finished();
+		return;
+	}
+
+	_num_put_fails++;
+
+	// Send it again, after a backoff, unless a later put to the same
+	// slot was issued, or it failed too often, or there are too many
+	// failures waiting already.
+	pp.tries++;
+	std::unique_lock<std::mutex> lck(_resend_mutex);
+	PutSlot slot(pp.key, pp.val->id);
+	auto latest = _put_latest.find(slot);
+	if (_put_latest.end() == latest or latest->second != pp.seq)
+	{
+		lck.unlock();
+		_num_put_superseded++;
+		put_finished();
+		return;
+	}
+	if (_resend_stop or MAX_PUT_TRIES <= pp.tries or
+	    MAX_RESEND_QUEUE <= _resend_queue.size())
+	{
+		put_retire(pp);
+		lck.unlock();
+		_num_put_lost++;
+		logger().warn("DHT put failed, and was given up on: %s",
+		              pp.key.toString().c_str());
+		put_finished();
+		return;
+	}
+
+	auto backoff = std::chrono::milliseconds(PUT_RETRY_DELAY << (pp.tries - 1));
+	_resend_slots[slot] = _resend_queue.emplace(now + backoff, std::move(pp));
+	_resend_max_depth = std::max(_resend_max_depth, _resend_queue.size());
+	_resend_cv.notify_all();
+}
+
+/// The fastest put completion of the current and the previous
+/// minimum window, in msecs. The caller must hold `_puts.mtx`.
+double DHTAtomStorage::put_min_rtt(void)
+{
+	if (0.0 == _put_min_prev) return _put_min_rtt;
+	return std::min(_put_min_rtt, _put_min_prev);
+}
+
+/// A put is no longer in flight.
+void DHTAtomStorage::put_finished(void)
+{
+	std::lock_guard<std::mutex> lck(_puts.mtx);
+	_puts.busy--;
+	_puts.done++;
+	_puts.cv.notify_all();
+}
+
+/// Wait until there is room in the put window. The `held` puts are
+/// counted as in flight, but are not on the network; these do not
+/// take up room in the window.
+void DHTAtomStorage::put_throttle(size_t held)
+{
+	size_t window;
+	{
+		std::lock_guard<std::mutex> lck(_puts.mtx);
+		window = (size_t) _put_window;
+	}
+	inflight_wait(_puts, window - 1 + held);
+}
+
+/// Send the failed puts again, when their backoff is up. They wait
+/// for room in the put window, like any other bulk put; else, the
+/// retries would add to the congestion that made them fail.
+void DHTAtomStorage::resend_loop(void)
+{
+	std::unique_lock<std::mutex> lck(_resend_mutex);
+	while (not _resend_stop)
+	{
+		if (_resend_queue.empty())
+		{
+			_resend_cv.wait(lck);
+			continue;
+		}
+		auto next = _resend_queue.begin();
+		if (std::chrono::steady_clock::now() < next->first)
+		{
+			_resend_cv.wait_until(lck, next->first);
+			continue;
+		}
+		PendingPut pp(std::move(next->second));
+		_resend_queue.erase(next);
+		PutSlot slot(pp.key, pp.val->id);
+		_resend_slots.erase(slot);
+
+		// The puts still waiting, and this one, are not on the network.
+		size_t held = _resend_queue.size() + 1;
+		lck.unlock();
+		try
+		{
+			put_throttle(held);
+		}
+		catch (const IOException& ex)
+		{
+			// Nothing is finishing; send it anyway.
+		}
+		lck.lock();
+
+		// A later put to the slot may have been issued meanwhile.
+		auto latest = _put_latest.find(slot);
+		if (_put_latest.end() == latest or latest->second != pp.seq)
+		{
+			lck.unlock();
+			_num_put_superseded++;
+			put_finished();
+			lck.lock();
+			continue;
+		}
+
+		lck.unlock();
+		_num_put_retries++;
+		send_put(std::move(pp));
+		lck.lock();
+	}
+}
+
+/// Stop the resender; the puts still waiting are given up on.
+void DHTAtomStorage::stop_resend(void)
+{
+	size_t dropped;
+	{
+		std::lock_guard<std::mutex> lck(_resend_mutex);
+		_resend_stop = true;
+		dropped = _resend_queue.size();
+		for (const auto& pr : _resend_queue)
+			put_retire(pr.second);
+		_resend_queue.clear();
+		_resend_slots.clear();
+	}
+	_resend_cv.notify_all();
+	_resender.join();
+
+	_num_put_lost += dropped;
+	for (size_t i = 0; i < dropped; i++) put_finished();
+}
+
+/* ================================================================== */
+// The dispatcher thread pool.
+
+/// Hand the task to the dispatcher threads. After shutdown has
+/// started, tasks are dropped on the floor; returns false if so.
+bool DHTAtomStorage::dispatch(std::function<void(void)>&& task)
+{
+	try { _dispatch_queue.push(std::move(task)); }
+	catch (const concurrent_queue<std::function<void(void)>>::Canceled& ex)
+	{
+		return false;
+	}
+	return true;
+}
+
+void DHTAtomStorage::dispatch_loop(void)
+{
+	while (true)
+	{
+		std::function<void(void)> task;
+		try { _dispatch_queue.pop(task); }
+		catch (const concurrent_queue<std::function<void(void)>>::Canceled& ex)
+		{
+			return;
+		}
+		task();
+	}
+}
+
+void DHTAtomStorage::start_dispatch(size_t nthreads)
+{
+	for (size_t i=0; i<nthreads; i++)
+		_dispatchers.push_back(std::thread(&DHTAtomStorage::dispatch_loop, this));
+}
+
+void DHTAtomStorage::stop_dispatch(void)
+{
+	_dispatch_queue.cancel();
+	for (std::thread& t : _dispatchers) t.join();
+	_dispatchers.clear();
+}
+
+/* ============================= END OF FILE ================= */
@@ -14,6 +14,71 @@
 using namespace opencog;
 
 /* ================================================================== */
+/**
+ * Fetch the incoming set of the indicated atom, restricted to Atoms
+ * of type `t` (or all of them, if `t` is NOTYPE), and add them to the
+ * table, together with their Values.
+ *
+ * Popular Atoms can have many thousands of holders; these are kept
+ * in a large set, which is read one trie node (one page) at a time.
+ * Fetching the holders one at a time, at two round-trips each, would
+ * take forever. So the holders are fetched concurrently, with up to
+ * `_incoming_window` of them in flight at a time. Each holder is
+ * added to the table as soon as it has arrived.
+ */
+void DHTAtomStorage::fetch_incoming(AtomTable& table, const Handle& h,
+                                    Type t)
+{
+	static dht::InfoHash zerohash;
+
+	dht::InfoHash mhash = read_membership(h);
+
+	// The walk over the large set, and the fetches of the holders,
+	// are tracked separately, so that a page handler can wait for
+	// room in the fetch window without waiting on itself. The page
+	// handlers use `fetch`; thus, it is declared first, so that it
+	// is destroyed last, after `walk` has waited for them, even when
+	// a wait below throws.
+	InFlight fetch;
+	InFlight walk;
+	large_set_walk(mhash, "",
+		[this, &table, &fetch, t](ValueSeq&& dincs)
+		{
+			for (const auto& dinc : dincs)
+			{
+				// std::cout << "Got incoming guid: "
+				//	   << dinc->unpack<dht::InfoHash>().toString() << std::endl;
+				dht::InfoHash inhash = dinc->unpack<dht::InfoHash>();
+
+				// Deleted links leave behind a zero hash.
+				if (inhash == zerohash) continue;
+
+				inflight_wait(fetch, _incoming_window - 1);
+				fetch_atom_async(inhash,
+					[this, &table, &fetch, t](const Handle& hin)
+					{
+						if (NOTYPE != t and hin->get_type() != t) return;
+
+						fetch_values_async(hin,
+							[this, &table](const Handle& hv)
+							{
+								// std::cout << "Got incoming Atom: "
+								//           << hv->to_string() << std::endl;
+								table.add(hv, false);
+								_num_get_inlinks++;
+							}, &fetch);
+					}, &fetch);
+			}
+		}, &walk);
+	// Both must be finished, before either error can be thrown;
+	// the handlers hold references to these locals.
+	inflight_wait(walk, 0);
+	inflight_drain(fetch);
+	inflight_drain(walk);
+
+	_num_get_insets++;
+}
+
 /**
  * Retreive the entire incoming set of the indicated atom.
  * This fetches the Atoms in the incoming set; the ValueSaveUTest
@@ -21,47 +86,17 @@ using namespace opencog;
  */
 void DHTAtomStorage::getIncomingSet(AtomTable& table, const Handle& h)
 {
-	dht::InfoHash mhash = get_membership(h);
-	auto dincs = get_stuff(mhash, _incoming_filter);
-	for (const auto& dinc : dincs)
-	{
-		// std::cout << "Got incoming guid: "
-		//	      << dinc->unpack<dht::InfoHash>().toString() << std::endl;
-		Handle h(fetch_values(fetch_atom(dinc->unpack<dht::InfoHash>())));
-		// std::cout << "Got incoming Atom: " << h->to_string() << std::endl;
-
-		table.add(h, false);
-	}
-
-	_num_get_insets++;
-	_num_get_inlinks += dincs.size();
+	fetch_incoming(table, h, NOTYPE);
 }
 
 /**
  * Retreive the incoming set of the indicated atom, but only those atoms
- * of type t.  This is done brute-force right now, and a faster, more
- * elegant version could be provided in the future, someday, I guess.
+ * of type t.  The holders still have to be fetched, to find out what
+ * type they are; but the Values are fetched only for those of type t.
  */
 void DHTAtomStorage::getIncomingByType(AtomTable& table, const Handle& h, Type t)
 {
-	dht::InfoHash mhash = get_membership(h);
-	auto dincs = get_stuff(mhash, _incoming_filter);
-	for (const auto& dinc : dincs)
-	{
-		// std::cout << "Got incoming guid: "
-		//	   << dinc->unpack<dht::InfoHash>().toString() << std::endl;
-		Handle h(fetch_atom(dinc->unpack<dht::InfoHash>()));
-		if (h->get_type() != t) continue;
-
-		Handle hv(fetch_values(std::move(h)));
-		// std::cout << "Got typed incoming Atom: "
-		//           << hv->to_string() << std::endl;
-
-		table.add(hv, false);
-		_num_get_inlinks ++;
-	}
-
-	_num_get_insets++;
+	fetch_incoming(table, h, t);
 }
 
 /* ============================= END OF FILE ================= */
@@ -0,0 +1,302 @@
+/*
+ * DHTLargeSet.cc
+ * Sets of unbounded size, mapped onto a hash-trie of DHT keys.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================== */
+/*
+ * OpenDHT will only hold about a thousand values on any one key (and
+ * no more than 64KBytes), and so a high-degree Atom cannot keep its
+ * entire incoming set on its MUID. The large set spreads the items
+ * over a trie of keys. The root of the trie is the original key, so
+ * that sets written before the trie existed are still readable. Each
+ * trie node holds at most LARGE_SET_NODE_SIZE items; once that is
+ * reached, a split marker is placed on the node, and further items go
+ * to one of the 16 children, chosen by the next hex digit of the item
+ * hash. Items are never moved; a reader just visits every node that
+ * is marked as split, all in parallel.
+ *
+ * The writer has to know how full a node is, before it can place an
+ * item there. This costs one get per trie node, the first time the
+ * node is touched; after that, the node is tracked locally, until it
+ * is pushed out of the (bounded) local cache. The get is not waited
+ * for: the insert is finished on a dispatcher thread, once the node
+ * arrives; barrier() waits for all of these. Other writers may be
+ * filling the same node at the same time, so the node size is a soft
+ * limit; it is set well under the OpenDHT hard limit.
+ */
+
+/// The hex digit of the item hash that picks the child at this depth.
+static char nibble(const dht::InfoHash& item, size_t depth)
+{
+	static const char hex[] = "0123456789abcdef";
+	uint8_t byte = item[depth/2];
+	return hex[(depth%2) ? (byte & 0xf) : (byte >> 4)];
+}
+
+/// The DHT key of the trie node at the given prefix.
+dht::InfoHash DHTAtomStorage::trie_key(const dht::InfoHash& root,
+                                       const std::string& prefix)
+{
+	if (prefix.empty()) return root;
+	return dht::InfoHash::get(root.toString() + "/" + prefix);
+}
+
+/**
+ * Run `work` once the trie node is known locally. If it is not, then
+ * it is fetched from the DHT, without waiting, and `work` is run on a
+ * dispatcher thread, after it arrives. All of the work waiting on the
+ * same node shares a single get.
+ */
+void DHTAtomStorage::with_trie_node(const dht::InfoHash& nkey, TrieWork&& work)
+{
+	bool known;
+	{
+		std::lock_guard<std::mutex> lck(_trie_mutex);
+		known = (nullptr != _trie_nodes.find(nkey));
+		if (not known)
+		{
+			auto& waiting = _trie_waiting[nkey];
+			waiting.emplace_back(std::move(work));
+			if (1 < waiting.size()) return;
+		}
+	}
+	if (known)
+	{
+		work();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lck(_trie_loads.mtx);
+		_trie_loads.busy++;
+	}
+
+	// Only the DHT runner thread touches `vals`, until it is handed
+	// over to the dispatcher.
+	auto vals = std::make_shared<ValueSeq>();
+	_runner.get(nkey,
+		[vals](const ValueSeq& got)->bool
+		{
+			vals->insert(vals->end(), got.begin(), got.end());
+			return true;
+		},
+		[this, nkey, vals]
+		(bool ok, const std::vector<std::shared_ptr<dht::Node>>&)
+		{
+			// During shutdown, the waiting work is dropped.
+			if (not dispatch([this, nkey, vals, ok](void)
+				{ trie_node_loaded(nkey, ok, *vals); }))
+				trie_node_loaded(nkey, false, ValueSeq());
+		},
+		_set_filter);
+}
+
+/// The trie node has arrived; run the work that was waiting on it.
+/// If it could not be fetched, that work is given up on.
+void DHTAtomStorage::trie_node_loaded(const dht::InfoHash& nkey, bool ok,
+                                      const ValueSeq& vals)
+{
+	std::vector<TrieWork> waiting;
+	{
+		std::lock_guard<std::mutex> lck(_trie_mutex);
+		if (ok and nullptr == _trie_nodes.find(nkey))
+		{
+			TrieNode node;
+			for (const auto& val : vals)
+			{
+				if (TRIE_ID == val->type) node.split = true;
+				else node.ids.insert(val->id);
+			}
+			_trie_nodes.put(nkey, node);
+		}
+		waiting.swap(_trie_waiting[nkey]);
+		_trie_waiting.erase(nkey);
+	}
+
+	if (not ok)
+	{
+		_num_put_lost += waiting.size();
+		logger().warn("Large set node %s could not be fetched; "
+		              "%zu updates given up on",
+		              nkey.toString().c_str(), waiting.size());
+	}
+	else for (TrieWork& work : waiting)
+	{
+		try { work(); }
+		catch (const std::exception& ex)
+		{
+			logger().warn("Large set update failed: %s", ex.what());
+		}
+	}
+
+	std::lock_guard<std::mutex> lck(_trie_loads.mtx);
+	_trie_loads.busy--;
+	_trie_loads.done++;
+	_trie_loads.cv.notify_all();
+}
+
+/* ================================================================== */
+
+/**
+ * Add the value `val` to the large set rooted at `root`. The `item`
+ * hash determines where the value goes in the trie. If a value with
+ * the same dht-id is already in the set, it is replaced. The value
+ * may be put after this returns; see with_trie_node().
+ */
+void DHTAtomStorage::large_set_insert(const dht::InfoHash& root,
+                                      const dht::InfoHash& item,
+                                      dht::Value&& val)
+{
+	trie_insert(root, item, std::make_shared<dht::Value>(std::move(val)), "");
+}
+
+/// Place the value in the trie node at `prefix`, or under it.
+void DHTAtomStorage::trie_insert(const dht::InfoHash& root,
+                                 const dht::InfoHash& item,
+                                 const std::shared_ptr<dht::Value>& val,
+                                 const std::string& prefix)
+{
+	if (2 * dht::InfoHash::size() <= prefix.size())
+		throw RuntimeException(TRACE_INFO, "Large set is full!");
+
+	dht::InfoHash nkey = trie_key(root, prefix);
+	with_trie_node(nkey, [this, root, item, val, prefix, nkey](void)
+	{
+		std::unique_lock<std::mutex> lck(_trie_mutex);
+		TrieNode* node = _trie_nodes.find(nkey);
+
+		// Pushed out of the cache, before we got to it.
+		if (nullptr == node)
+		{
+			lck.unlock();
+			trie_insert(root, item, val, prefix);
+			return;
+		}
+
+		if (0 < node->ids.count(val->id) or
+		    (not node->split and node->ids.size() < LARGE_SET_NODE_SIZE))
+		{
+			node->ids.insert(val->id);
+			lck.unlock();
+			put_stuff(nkey, std::move(*val));
+			return;
+		}
+
+		// This node is full; mark it as split, and go deeper.
+		bool mark = not node->split;
+		node->split = true;
+		lck.unlock();
+		if (mark)
+			put_stuff(nkey, dht::Value(_trie_policy, std::string("split"), 1));
+
+		trie_insert(root, item, val, prefix + nibble(item, prefix.size()));
+	});
+}
+
+/**
+ * Replace the value in the large set that has the same dht-id as
+ * the `tombstone`, by the `tombstone`. Does nothing, if there is no
+ * such value. As with inserts, this may be finished after it returns.
+ */
+void DHTAtomStorage::large_set_remove(const dht::InfoHash& root,
+                                      const dht::InfoHash& item,
+                                      dht::Value&& tombstone)
+{
+	trie_remove(root, item,
+	            std::make_shared<dht::Value>(std::move(tombstone)), "");
+}
+
+/// Look for the value in the trie node at `prefix`, and under it.
+void DHTAtomStorage::trie_remove(const dht::InfoHash& root,
+                                 const dht::InfoHash& item,
+                                 const std::shared_ptr<dht::Value>& tombstone,
+                                 const std::string& prefix)
+{
+	if (2 * dht::InfoHash::size() <= prefix.size()) return;
+
+	dht::InfoHash nkey = trie_key(root, prefix);
+	with_trie_node(nkey, [this, root, item, tombstone, prefix, nkey](void)
+	{
+		std::unique_lock<std::mutex> lck(_trie_mutex);
+		const TrieNode* node = _trie_nodes.find(nkey);
+		if (nullptr == node)
+		{
+			lck.unlock();
+			trie_remove(root, item, tombstone, prefix);
+			return;
+		}
+		if (0 < node->ids.count(tombstone->id))
+		{
+			lck.unlock();
+			put_stuff(nkey, std::move(*tombstone));
+			return;
+		}
+		if (not node->split) return;
+		lck.unlock();
+
+		trie_remove(root, item, tombstone, prefix + nibble(item, prefix.size()));
+	});
+}
+
+/* ================================================================== */
+
+/**
+ * Walk the large set, starting at the trie node at `prefix`. The
+ * `page` callback is called once for each trie node, with the items
+ * held in that node, as soon as they arrive. The children of split
+ * nodes are all requested at once, before the page is handled.
+ */
+void DHTAtomStorage::large_set_walk(const dht::InfoHash& root,
+                                    const std::string& prefix,
+                                    const GetReply& page,
+                                    InFlight* ifl)
+{
+	get_async(trie_key(root, prefix),
+		[this, root, prefix, page, ifl](ValueSeq&& vals)
+		{
+			bool split = false;
+			ValueSeq items;
+			for (auto& val : vals)
+			{
+				if (TRIE_ID == val->type) split = true;
+				else items.emplace_back(std::move(val));
+			}
+
+			if (split and prefix.size() < 2 * dht::InfoHash::size())
+			{
+				for (const char c : std::string("0123456789abcdef"))
+					large_set_walk(root, prefix + c, page, ifl);
+			}
+
+			page(std::move(items));
+		}, _set_filter, ifl);
+}
+
+/// Get all of the items in the large set, and wait for them.
+DHTAtomStorage::ValueSeq
+DHTAtomStorage::large_set_get(const dht::InfoHash& root)
+{
+	std::mutex mtx;
+	ValueSeq all;
+	InFlight ifl;
+	large_set_walk(root, "",
+		[&mtx, &all](ValueSeq&& items)
+		{
+			std::lock_guard<std::mutex> lck(mtx);
+			all.insert(all.end(), items.begin(), items.end());
+		}, &ifl);
+	inflight_drain(ifl);
+	return all;
+}
+
+/* ============================= END OF FILE ================= */
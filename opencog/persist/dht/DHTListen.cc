@@ -0,0 +1,188 @@
+/*
+ * DHTListen.cc
+ * Follow changes made to the AtomSpace by other DHT nodes.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atomspace/AtomSpace.h>
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================== */
+/*
+ * Subscriptions use DhtRunner::listen(). The DHT nodes holding a key
+ * push any new or changed value on that key to the listener. As with
+ * gets, the listen callbacks run on the DHT runner thread; they only
+ * hand the values over to the dispatcher threads, which decode them
+ * and change the AtomSpace.
+ *
+ * A fresh listener is first sent everything already on the key; the
+ * Atoms and Values that are already in the AtomSpace are not changed.
+ * Our own stores come back to us, too; these are likewise no-ops.
+ *
+ * Anyone on the network can put anything on these keys; a record that
+ * cannot be decoded is logged, and skipped.
+ */
+
+/// Listen on the key, and pass the non-expired values to `reply`,
+/// on a dispatcher thread. Returns false, and does nothing, if the
+/// key is already being listened to.
+bool DHTAtomStorage::listen_key(const dht::InfoHash& key,
+                                const dht::Value::Filter& filter,
+                                GetReply reply)
+{
+	std::lock_guard<std::mutex> lck(_listen_mutex);
+	for (const auto& lsn : _listeners)
+		if (lsn.first == key) return false;
+
+	std::shared_future<size_t> token = _runner.listen(key,
+		[this, reply, key](const ValueSeq& vals, bool expired)->bool
+		{
+			// Expiry is not deletion; drops are explicit records.
+			if (expired) return true;
+			auto got = std::make_shared<ValueSeq>(vals);
+			dispatch([reply, got, key](void)
+			{
+				try
+				{
+					reply(std::move(*got));
+				}
+				catch (const std::exception& ex)
+				{
+					logger().warn("DHT listen on %s: bad record: %s",
+					              key.toString().c_str(), ex.what());
+				}
+				catch (...)
+				{
+					logger().warn("DHT listen on %s: bad record",
+					              key.toString().c_str());
+				}
+			});
+			return true;
+		},
+		filter);
+
+	_listeners.emplace_back(key, token);
+	return true;
+}
+
+/// Stop all subscriptions.
+void DHTAtomStorage::cancel_listens(void)
+{
+	std::lock_guard<std::mutex> lck(_listen_mutex);
+	for (const auto& lsn : _listeners)
+		_runner.cancelListen(lsn.first, lsn.second);
+	_listeners.clear();
+	_listen_stamps.clear();
+}
+
+/* ================================================================== */
+
+/// Record the timestamp of a membership record of the Atom with the
+/// given dht-id, if it is the latest seen. Returns false if a later
+/// record has already been seen.
+bool DHTAtomStorage::listen_current(dht::Value::Id id, double stamp)
+{
+	std::lock_guard<std::mutex> lck(_listen_mutex);
+	double* last = _listen_stamps.find(id);
+	if (last and stamp < *last) return false;
+	_listen_stamps.put(id, stamp);
+	return true;
+}
+
+/**
+ * Apply one AtomSpace membership record to the AtomSpace. The records
+ * for an Atom can arrive in any order, from different keys; only the
+ * one with the latest timestamp counts. An add is applied after its
+ * Values have arrived, and only if no later record came in meanwhile.
+ */
+void DHTAtomStorage::apply_space_record(AtomSpace* as, dht::Value::Id id,
+                                        const std::string& sname)
+{
+	SpaceRecord rec;
+	if (not parse_space_record(sname, rec)) return;
+	if (not listen_current(id, rec.stamp)) return;
+
+	Handle h(decode_space_record(sname, rec));
+	if (rec.add)
+	{
+		if (as->get_atom(h)) return;
+		double stamp = rec.stamp;
+		fetch_values_async(h,
+			[this, as, id, stamp](const Handle& hv)
+			{
+				if (not listen_current(id, stamp)) return;
+				as->add_atom(hv);
+				_listen_adds++;
+			});
+		return;
+	}
+
+	if (drop_local(as, h)) _listen_drops++;
+}
+
+/// Remove an Atom that was deleted by someone else from the local
+/// AtomSpace. Forget that it was published, so that storing it again
+/// re-creates it. Returns false if the Atom was not there.
+bool DHTAtomStorage::drop_local(AtomSpace* as, const Handle& h)
+{
+	Handle local(as->get_atom(h));
+	if (nullptr == local) return false;
+	_published.erase(local);
+	_remote_values.erase(local);
+	as->extract_atom(local, true);
+	return true;
+}
+
+/**
+ * Follow the additions and deletions of Atoms in the AtomSpace, as
+ * they are made, by listening on all of the AtomSpace buckets. This
+ * also loads everything currently in the AtomSpace.
+ */
+void DHTAtomStorage::listen_atomspace(AtomSpace* as)
+{
+	// Each record on its own; a bad one does not stop the others.
+	auto apply = [this, as](ValueSeq&& vals)
+	{
+		for (const auto& val : vals)
+		{
+			try
+			{
+				apply_space_record(as, val->id, val->unpack<std::string>());
+			}
+			catch (const std::exception& ex)
+			{
+				logger().warn("DHT listen: bad membership record: %s",
+				              ex.what());
+			}
+		}
+	};
+
+	listen_key(dht::InfoHash::get(_atomspace_name), _space_filter, apply);
+	for (size_t bucket = 0; bucket < NUM_SPACE_BUCKETS; bucket++)
+		listen_key(get_bucket(_atomspace_name, bucket), _space_filter, apply);
+}
+
+/**
+ * Follow changes to the Values on the Atom, as they are made. The
+ * Atom is added to the AtomSpace, if it is not there already. Asking
+ * again for the same Atom does nothing.
+ */
+void DHTAtomStorage::listen_values(AtomSpace* as, const Handle& h)
+{
+	Handle atom(as->add_atom(h));
+	listen_key(read_membership(atom), _values_filter,
+		[this, atom](ValueSeq&& vals)
+		{
+			Handle local(atom);
+			decode_values(local, vals);
+			_listen_values++;
+		});
+}
+
+/* ============================= END OF FILE ================= */
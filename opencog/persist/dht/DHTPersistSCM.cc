@@ -52,6 +52,18 @@ void DHTPersistSCM::init(void)
     define_scheme_primitive("dht-stats", &DHTPersistSCM::do_stats, this, "persist-dht");
     define_scheme_primitive("dht-clear-stats", &DHTPersistSCM::do_clear_stats, this, "persist-dht");
     define_scheme_primitive("dht-load-atomspace", &DHTPersistSCM::do_load_atomspace, this, "persist-dht");
+    define_scheme_primitive("dht-refresh-atomspace", &DHTPersistSCM::do_refresh_atomspace, this, "persist-dht");
+    define_scheme_primitive("dht-open-disk-cache", &DHTPersistSCM::do_open_disk_cache, this, "persist-dht");
+    define_scheme_primitive("dht-export-snapshot", &DHTPersistSCM::do_export_snapshot, this, "persist-dht");
+    define_scheme_primitive("dht-import-snapshot", &DHTPersistSCM::do_import_snapshot, this, "persist-dht");
+    define_scheme_primitive("dht-publish-snapshot", &DHTPersistSCM::do_publish_snapshot, this, "persist-dht");
+    define_scheme_primitive("dht-fetch-snapshot", &DHTPersistSCM::do_fetch_snapshot, this, "persist-dht");
+    define_scheme_primitive("dht-listen-atomspace", &DHTPersistSCM::do_listen_atomspace, this, "persist-dht");
+    define_scheme_primitive("dht-listen-values", &DHTPersistSCM::do_listen_values, this, "persist-dht");
+    define_scheme_primitive("dht-counter-key", &DHTPersistSCM::do_counter_key, this, "persist-dht");
+    define_scheme_primitive("dht-set-load-window", &DHTPersistSCM::do_set_load_window, this, "persist-dht");
+    define_scheme_primitive("dht-set-cache-capacity", &DHTPersistSCM::do_set_cache_capacity, this, "persist-dht");
+    define_scheme_primitive("dht-set-write-behind", &DHTPersistSCM::do_set_write_behind, this, "persist-dht");
 
     define_scheme_primitive("dht-examine", &DHTPersistSCM::do_examine, this, "persist-dht");
     define_scheme_primitive("dht-atomspace-hash", &DHTPersistSCM::do_atomspace_hash, this, "persist-dht");
@@ -207,6 +219,126 @@ void DHTPersistSCM::do_load_atomspace(const std::string& asname)
     _backing->load_atomspace(_as, asname);
 }
 
+void DHTPersistSCM::do_refresh_atomspace(const std::string& asname)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-refresh-atomspace: Error: AtomSpace not connected to DHT!");
+
+    _backing->load_atomspace(_as, asname, true);
+}
+
+void DHTPersistSCM::do_open_disk_cache(const std::string& path)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-open-disk-cache: Error: AtomSpace not connected to DHT!");
+
+    _backing->open_disk_cache(path);
+}
+
+void DHTPersistSCM::do_export_snapshot(const std::string& path)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-export-snapshot: Error: AtomSpace not connected to DHT!");
+
+    _backing->export_snapshot(_as, path);
+}
+
+void DHTPersistSCM::do_import_snapshot(const std::string& path)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-import-snapshot: Error: AtomSpace not connected to DHT!");
+
+    _backing->import_snapshot(_as, path);
+}
+
+std::string DHTPersistSCM::do_publish_snapshot(const std::string& path)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-publish-snapshot: Error: AtomSpace not connected to DHT!");
+
+    return _backing->publish_snapshot(path);
+}
+
+std::string DHTPersistSCM::do_fetch_snapshot(const std::string& path)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-fetch-snapshot: Error: AtomSpace not connected to DHT!");
+
+    std::string hash = _backing->latest_snapshot();
+    if (hash.empty())
+        throw RuntimeException(TRACE_INFO,
+            "dht-fetch-snapshot: Error: No snapshot has been published!");
+
+    _backing->fetch_snapshot(hash, path);
+    return hash;
+}
+
+void DHTPersistSCM::do_listen_atomspace(void)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-listen-atomspace: Error: AtomSpace not connected to DHT!");
+
+    _backing->listen_atomspace(_as);
+}
+
+void DHTPersistSCM::do_listen_values(const Handle& h)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-listen-values: Error: AtomSpace not connected to DHT!");
+
+    _backing->listen_values(_as, h);
+}
+
+void DHTPersistSCM::do_counter_key(const Handle& key)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-counter-key: Error: AtomSpace not connected to DHT!");
+
+    _backing->add_counter_key(key);
+}
+
+void DHTPersistSCM::do_set_load_window(int window)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-set-load-window: Error: AtomSpace not connected to DHT!");
+    if (window <= 0)
+        throw RuntimeException(TRACE_INFO,
+            "dht-set-load-window: Error: window must be positive!");
+
+    _backing->set_load_window(window);
+}
+
+void DHTPersistSCM::do_set_cache_capacity(int capacity)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-set-cache-capacity: Error: AtomSpace not connected to DHT!");
+    if (capacity <= 0)
+        throw RuntimeException(TRACE_INFO,
+            "dht-set-cache-capacity: Error: capacity must be positive!");
+
+    _backing->set_cache_capacity(capacity);
+}
+
+void DHTPersistSCM::do_set_write_behind(bool on)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-set-write-behind: Error: AtomSpace not connected to DHT!");
+
+    _backing->set_write_behind(on);
+}
+
 void DHTPersistSCM::do_stats(void)
 {
     if (nullptr == _backing) {
@@ -49,6 +49,18 @@ public:
 	std::string do_routing_tables_log(void);
 	std::string do_searches_log(void);
 	void do_load_atomspace(const std::string&);
+	void do_refresh_atomspace(const std::string&);
+	void do_open_disk_cache(const std::string&);
+	void do_export_snapshot(const std::string&);
+	void do_import_snapshot(const std::string&);
+	std::string do_publish_snapshot(const std::string&);
+	std::string do_fetch_snapshot(const std::string&);
+	void do_listen_atomspace(void);
+	void do_listen_values(const Handle&);
+	void do_counter_key(const Handle&);
+	void do_set_load_window(int);
+	void do_set_cache_capacity(int);
+	void do_set_write_behind(bool);
 
 	void do_stats(void);
 	void do_clear_stats(void);
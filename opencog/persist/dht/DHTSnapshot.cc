@@ -0,0 +1,325 @@
+/*
+ * DHTSnapshot.cc
+ * Export and import of whole AtomSpaces as single snapshot files.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+
+#include <msgpack.hpp>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atomspace/AtomSpace.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================== */
+/*
+ * A snapshot is a file holding an entire AtomSpace, Values and all.
+ * Loading it takes one pass over a local file, instead of one DHT get
+ * per Atom, and one more for its Values.
+ *
+ * The file is a sequence of MessagePack objects:
+ *
+ *    [SNAPSHOT_MAGIC, SNAPSHOT_FORMAT, atomspace-name, number-of-atoms]
+ *
+ * followed by, for each Atom,
+ *
+ *    guid   the GUID of the Atom
+ *    atom   the binary Atom record, exactly as made by encode_atom()
+ *    values the Values, exactly as made by encode_values(), or nil
+ *
+ * The Atoms are written in dependency order: every Atom comes after
+ * all of the Atoms in its outgoing set. Thus, the Link records, which
+ * reference their outgoing set by GUID, can be decoded in one pass.
+ *
+ * A snapshot can be shared through the DHT: it is cut into chunks of
+ * SNAPSHOT_CHUNK bytes, each stored under its own SHA-1, and a
+ * manifest listing the chunk hashes is stored under the SHA-1 of the
+ * whole file. The file hash is also published under the AtomSpace, so
+ * that peers can find the most recent snapshot.
+ */
+
+#define SNAPSHOT_MAGIC "opencog-atomspace-snapshot"
+#define SNAPSHOT_FORMAT 1
+
+// Well under the OpenDHT limit of 64KBytes per value.
+#define SNAPSHOT_CHUNK (48*1024)
+
+/// The DHT key holding the hash of the latest snapshot of the space.
+dht::InfoHash DHTAtomStorage::snapshot_key(const std::string& spacename)
+{
+	return space_key(spacename, "snapshot");
+}
+
+/// Snapshot chunks and manifests are named by their hash, and never
+/// change. The announcement of the latest snapshot is replaced by the
+/// next one.
+bool DHTAtomStorage::cy_edit_snapshot(dht::InfoHash key,
+                              const std::shared_ptr<dht::Value>& old_val,
+                              std::shared_ptr<dht::Value>& new_val,
+                              const dht::InfoHash& from,
+                              const dht::SockAddr& addr)
+{
+	return true;
+}
+
+/* ================================================================== */
+
+/// Write out the Atom, after everything in its outgoing set.
+void DHTAtomStorage::export_atom(std::ofstream& ofs, const Handle& h,
+                                 UnorderedHandleSet& done)
+{
+	if (not done.insert(h).second) return;
+	if (h->is_link())
+		for (const Handle& held : h->getOutgoingSet())
+			export_atom(ofs, held, done);
+
+	msgpack::packer<std::ofstream> pk(&ofs);
+	pk.pack(get_guid(h));
+
+	dht::Blob ablob(encode_atom(h));
+	ofs.write((const char*) ablob.data(), ablob.size());
+
+	if (h->getKeys().empty())
+	{
+		pk.pack_nil();
+		return;
+	}
+	dht::Blob vblob(encode_values(h));
+	ofs.write((const char*) vblob.data(), vblob.size());
+}
+
+/// Write the entire AtomSpace to a snapshot file.
+void DHTAtomStorage::export_snapshot(AtomSpace* as, const std::string& path)
+{
+	std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+	if (not ofs)
+		throw IOException(TRACE_INFO, "Cannot write snapshot %s",
+			path.c_str());
+
+	HandleSeq hseq;
+	as->get_handles_by_type(hseq, ATOM, true);
+
+	msgpack::packer<std::ofstream> pk(&ofs);
+	pk.pack_array(4);
+	pk.pack(std::string(SNAPSHOT_MAGIC));
+	pk.pack(SNAPSHOT_FORMAT);
+	pk.pack(_atomspace_name);
+	pk.pack(hseq.size());
+
+	UnorderedHandleSet done;
+	for (const Handle& h : hseq)
+		export_atom(ofs, h, done);
+
+	ofs.close();
+	if (not ofs)
+		throw IOException(TRACE_INFO, "Failed writing snapshot %s",
+			path.c_str());
+}
+
+/* ================================================================== */
+
+/// Read-only memory map of a whole file.
+struct MappedFile
+{
+	const char* data = nullptr;
+	size_t size = 0;
+
+	MappedFile(const std::string& path)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw IOException(TRACE_INFO, "Cannot open snapshot %s",
+				path.c_str());
+		struct stat st;
+		if (fstat(fd, &st))
+		{
+			close(fd);
+			throw IOException(TRACE_INFO, "Cannot stat snapshot %s",
+				path.c_str());
+		}
+		size = st.st_size;
+		if (0 == size)
+		{
+			close(fd);
+			throw IOException(TRACE_INFO, "Empty snapshot %s",
+				path.c_str());
+		}
+		void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (MAP_FAILED == map)
+			throw IOException(TRACE_INFO, "Cannot map snapshot %s",
+				path.c_str());
+		data = (const char*) map;
+	}
+	~MappedFile() { if (data) munmap((void*) data, size); }
+};
+
+/// Load all of the Atoms and Values in the snapshot file into the
+/// AtomSpace.
+void DHTAtomStorage::import_snapshot(AtomSpace* as, const std::string& path)
+{
+	MappedFile mf(path);
+	size_t off = 0;
+
+	msgpack::object_handle oh = msgpack::unpack(mf.data, mf.size, off);
+	const msgpack::object& hdr = oh.get();
+	if (msgpack::type::ARRAY != hdr.type or 4 != hdr.via.array.size or
+	    hdr.via.array.ptr[0].as<std::string>() != SNAPSHOT_MAGIC)
+		throw IOException(TRACE_INFO, "Not an AtomSpace snapshot: %s",
+			path.c_str());
+	if (SNAPSHOT_FORMAT != hdr.via.array.ptr[1].as<int>())
+		throw IOException(TRACE_INFO, "Unknown snapshot format in %s",
+			path.c_str());
+
+	size_t natoms = hdr.via.array.ptr[3].as<size_t>();
+	GuidMap atoms;
+	for (size_t i = 0; i < natoms; i++)
+	{
+		oh = msgpack::unpack(mf.data, mf.size, off);
+		dht::InfoHash guid = oh.get().as<dht::InfoHash>();
+
+		// The outgoing set was written before this Atom, and so it
+		// is already in the map. The cache cannot be used for this;
+		// Atoms may have been evicted from it.
+		oh = msgpack::unpack(mf.data, mf.size, off);
+		Handle h(decode_atom(oh.get(), &atoms));
+		atoms[guid] = h;
+		_decode_map.put(guid, h);
+
+		size_t voff = off;
+		oh = msgpack::unpack(mf.data, mf.size, off);
+		if (msgpack::type::NIL != oh.get().type)
+			decode_values(h, dht::Blob(mf.data + voff, mf.data + off));
+
+		as->add_atom(h);
+		_load_count++;
+	}
+}
+
+/* ================================================================== */
+
+/**
+ * Put the snapshot file into the DHT, and announce it as the latest
+ * snapshot of this AtomSpace. Returns the hash of the file, which is
+ * all that is needed to fetch it again.
+ */
+std::string DHTAtomStorage::publish_snapshot(const std::string& path)
+{
+	if (_observing_only)
+		throw IOException(TRACE_INFO, "DHT Node is only observing!");
+
+	MappedFile mf(path);
+
+	std::vector<dht::InfoHash> chunks;
+	for (size_t off = 0; off < mf.size; off += SNAPSHOT_CHUNK)
+	{
+		size_t len = std::min((size_t) SNAPSHOT_CHUNK, mf.size - off);
+		dht::Blob chunk(mf.data + off, mf.data + off + len);
+		dht::InfoHash ckey = dht::InfoHash::get(chunk);
+		chunks.push_back(ckey);
+		put_stuff(ckey, dht::Value(SNAPSHOT_ID, chunk, 1));
+		put_throttle();
+	}
+
+	msgpack::sbuffer buf;
+	msgpack::packer<msgpack::sbuffer> pk(&buf);
+	pk.pack_array(3);
+	pk.pack(SNAPSHOT_FORMAT);
+	pk.pack(mf.size);
+	pk.pack(chunks);
+
+	dht::InfoHash fkey = dht::InfoHash::get((const uint8_t*) mf.data, mf.size);
+	put_stuff(fkey, dht::Value(SNAPSHOT_ID,
+		dht::Blob(buf.data(), buf.data() + buf.size()), 1));
+
+	// The announcement; a newer one replaces an older one.
+	put_stuff(snapshot_key(_atomspace_name), dht::Value(SNAPSHOT_ID,
+		dht::Blob(fkey.data(), fkey.data() + fkey.size()), 1));
+
+	barrier();
+	return fkey.toString();
+}
+
+/// Return the hash of the latest snapshot of the AtomSpace, or the
+/// empty string, if there is none.
+std::string DHTAtomStorage::latest_snapshot(void)
+{
+	for (const auto& dval : get_stuff(snapshot_key(_atomspace_name),
+	                                  _snapshot_filter))
+	{
+		if (dht::HASH_LEN == dval->data.size())
+			return dht::InfoHash(dval->data.data(), dht::HASH_LEN).toString();
+	}
+	return "";
+}
+
+/**
+ * Fetch the snapshot with the given file hash from the DHT, and write
+ * it to the file at `path`. All of the chunks are fetched at once;
+ * each is checked against its hash, and so is the whole file.
+ */
+void DHTAtomStorage::fetch_snapshot(const std::string& hash,
+                                    const std::string& path)
+{
+	dht::InfoHash fkey(hash);
+	ValueSeq mvals = get_stuff(fkey, _snapshot_filter);
+	if (mvals.empty())
+		throw IOException(TRACE_INFO, "Snapshot %s not found", hash.c_str());
+
+	msgpack::object_handle oh = msgpack::unpack(
+		(const char*) mvals[0]->data.data(), mvals[0]->data.size());
+	const msgpack::object& man = oh.get();
+	if (msgpack::type::ARRAY != man.type or 3 != man.via.array.size or
+	    SNAPSHOT_FORMAT != man.via.array.ptr[0].as<int>())
+		throw IOException(TRACE_INFO, "Bad snapshot manifest %s", hash.c_str());
+
+	size_t fsize = man.via.array.ptr[1].as<size_t>();
+	auto chunks = man.via.array.ptr[2].as<std::vector<dht::InfoHash>>();
+
+	std::vector<dht::Blob> parts(chunks.size());
+	InFlight ifl;
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		inflight_wait(ifl, _load_window - 1);
+		dht::InfoHash ckey = chunks[i];
+		get_async(ckey,
+			[&parts, i, ckey](ValueSeq&& cvals)
+			{
+				for (const auto& cval : cvals)
+				{
+					if (dht::InfoHash::get(cval->data) != ckey) continue;
+					parts[i] = cval->data;
+					return;
+				}
+				throw IOException(TRACE_INFO, "Snapshot chunk %s is missing",
+					ckey.toString().c_str());
+			}, _snapshot_filter, &ifl);
+	}
+	inflight_drain(ifl);
+
+	dht::Blob whole;
+	whole.reserve(fsize);
+	for (const dht::Blob& part : parts)
+		whole.insert(whole.end(), part.begin(), part.end());
+	if (whole.size() != fsize or dht::InfoHash::get(whole) != fkey)
+		throw IOException(TRACE_INFO, "Snapshot %s is corrupt", hash.c_str());
+
+	std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+	ofs.write((const char*) whole.data(), whole.size());
+	ofs.close();
+	if (not ofs)
+		throw IOException(TRACE_INFO, "Failed writing snapshot %s",
+			path.c_str());
+}
+
+/* ============================= END OF FILE ================= */
@@ -5,6 +5,9 @@
  * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
  * SPDX-License-Identifier: AGPL-3.0-or-later
  */
+#include <msgpack.hpp>
+
+#include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atoms/value/FloatValue.h>
 #include <opencog/atoms/value/LinkValue.h>
@@ -27,16 +30,26 @@ void DHTAtomStorage::store_atom_values(const Handle& atom)
 	if (_observing_only)
 		throw IOException(TRACE_INFO, "DHT Node is only observing!");
 
+	// The Values about to be stored replace those under the older
+	// MUID; there is no need to copy those.
+	migrate_legacy(atom, false);
 	dht::InfoHash muid = get_membership(atom);
 
 	// If there are no keys currently on the atom, but there are values
-	// in the DHT, then we need to clobber the values in the DHT.  Try
-	// to avoid having to to a put, by doing a get first.  Maybe we can
-	// get more efficient by caching?
+	// in the DHT, then we need to clobber the values in the DHT. If
+	// we already know what the DHT holds, then there's nothing to ask;
+	// otherwise, find out in the background, so that the store does
+	// not have to wait for a network round-trip.
 	if (0 == atom->getKeys().size())
 	{
-		auto dvals = get_stuff(muid, _values_filter);
-		if (0 < dvals.size())
+		// Deleting the Values deletes the counters, too.
+		counter_tombstones(atom);
+
+		std::lock_guard<std::mutex> lck(values_lock(atom));
+		bool remote;
+		if (not remote_values_get(atom, remote))
+			verify_values_async(atom);
+		else if (remote)
 			delete_atom_values(atom);
 		return;
 	}
@@ -45,13 +58,374 @@ void DHTAtomStorage::store_atom_values(const Handle& atom)
 	for (const Handle& key : atom->getKeys())
 		store_recursive(key);
 
-	// Attach the value to the atom
-	_runner.put(muid,
-		dht::Value(_values_policy, Sexpr::encode_atom_values(atom), 1));
+	// Attach the value to the atom.
+	dht::Blob blob(encode_values(atom, counter_tombstones(atom)));
+	{
+		std::lock_guard<std::mutex> lck(values_lock(atom));
+		put_stuff(muid, dht::Value(VALUES_ID, blob, 1));
+		remote_values_put(atom, true);
+	}
+	bloom_add(muid);
 
 	_value_updates ++;
 }
 
+// What is known about the Values held in the DHT is trusted for this
+// many seconds; after that, the Atom is checked again.
+#define REMOTE_VALUES_TTL 300
+
+/// Look up what is known about the Values that the DHT holds for the
+/// Atom. Returns false if nothing is known, or if it is too old.
+bool DHTAtomStorage::remote_values_get(const Handle& atom, bool& held)
+{
+	RemoteValues rv;
+	if (not _remote_values.get(atom, rv)) return false;
+	if (rv.seen + std::chrono::seconds(REMOTE_VALUES_TTL) <
+	    std::chrono::steady_clock::now())
+	{
+		_remote_values.erase(atom);
+		return false;
+	}
+	held = rv.held;
+	return true;
+}
+
+void DHTAtomStorage::remote_values_put(const Handle& atom, bool held)
+{
+	_remote_values.put(atom, {held, std::chrono::steady_clock::now()});
+}
+
+/// The lock on the Values of the Atom.
+std::mutex& DHTAtomStorage::values_lock(const Handle& atom)
+{
+	return _values_locks[atom->get_hash() % NUM_VALUES_LOCKS];
+}
+
+// The most Atoms that wait for a check; past this, the Values are
+// deleted without asking.
+#define MAX_VERIFY_QUEUE 65536
+
+/// Find out if the DHT is holding Values for an Atom that has none,
+/// and delete them if so. This does not wait: the Atom is queued, and
+/// up to `_load_window` checks are kept in flight. The answers are
+/// handled on a dispatcher thread; barrier() waits for all of these
+/// to finish.
+///
+/// Nothing is asked, if the has-values summary already says that the
+/// DHT holds no Values for the Atom. If the queue is full, the Values
+/// are deleted right away; that costs one put, instead of a get, and
+/// is harmless if there were none. The caller holds values_lock().
+void DHTAtomStorage::verify_values_async(const Handle& atom)
+{
+	if (not is_legacy(atom) and not bloom_test(get_membership(atom)))
+	{
+		remote_values_put(atom, false);
+		return;
+	}
+
+	bool full;
+	{
+		std::lock_guard<std::mutex> lck(_verify_mutex);
+		full = MAX_VERIFY_QUEUE <= _verify_queue.size();
+		if (not full) _verify_queue.push_back(atom);
+	}
+	if (full)
+	{
+		delete_atom_values(atom);
+		return;
+	}
+	verify_next(0);
+}
+
+/// Start as many of the queued checks as there is room for. The
+/// reply handler of a check calls this, too; it passes `self` = 1,
+/// as its own check is still counted as being in flight.
+void DHTAtomStorage::verify_next(size_t self)
+{
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> lck(_verify_values.mtx);
+			if (_load_window + self <= _verify_values.busy) return;
+		}
+
+		Handle atom;
+		{
+			std::lock_guard<std::mutex> lck(_verify_mutex);
+			if (_verify_queue.empty()) return;
+			atom = _verify_queue.front();
+			_verify_queue.pop_front();
+		}
+
+		_value_verifies ++;
+		get_async(get_membership(atom),
+			[this, atom](ValueSeq&& dvals)
+			{
+				{
+					// If the Atom was stored or deleted while we were
+					// waiting, then the DHT state is already known, and
+					// is newer. The lock keeps it from being stored
+					// between this check and the delete; an Atom that
+					// has gained keys is about to be stored, anyway.
+					std::lock_guard<std::mutex> lck(values_lock(atom));
+					bool remote;
+					if (atom->getKeys().empty() and
+					    not remote_values_get(atom, remote))
+					{
+						unsigned long timestamp = 0;
+						std::shared_ptr<dht::Value> latest;
+						for (const auto& dval : dvals)
+						{
+							if (timestamp < dval->id)
+							{
+								timestamp = dval->id;
+								latest = dval;
+							}
+						}
+						if (latest and has_values(latest->data))
+							delete_atom_values(atom);
+						else
+							remote_values_put(atom, false);
+					}
+				}
+				verify_next(1);
+			}, _values_filter, &_verify_values);
+	}
+}
+
+/// Wait until all of the queued checks are done. A check that failed
+/// does not start the next one; these are started here.
+void DHTAtomStorage::verify_drain(void)
+{
+	while (true)
+	{
+		verify_next(0);
+		inflight_wait(_verify_values, 0);
+
+		std::lock_guard<std::mutex> lck(_verify_mutex);
+		if (_verify_queue.empty()) return;
+	}
+}
+
+/* ================================================================== */
+// Binary encoding of Values.
+//
+// The Values on an Atom are encoded with MessagePack, as
+//
+//    [VALUES_FORMAT, [[key, value], [key, value], ...]]
+//
+// where each key is the s-expression string for the key Atom, and
+// each value is a pair [type-name, payload]. For FloatValues and the
+// common TruthValues, the payload is an array of doubles; these are
+// bit-exact, and much smaller than their decimal text form. For
+// StringValues, it is an array of strings, and for LinkValues, an
+// array of (recursively encoded) values. Anything else (Atoms, and
+// the more exotic value types) has an s-expression string payload.
+//
+// Values under a counter key have a third element: the counter state
+// (see DHTCounter.cc). The count in the value itself is ignored, when
+// decoding; it is worked out from the counter state. A counter that
+// was removed has a nil value; the key is removed, when decoding.
+//
+// Older records hold the Values as an s-expression alist, packed as
+// a MessagePack string. These are still decoded.
+
+#define VALUES_FORMAT 1
+
+using Packer = msgpack::packer<msgpack::sbuffer>;
+
+static void pack_value(Packer& pk, const ValuePtr& v)
+{
+	Type t = v->get_type();
+	pk.pack_array(2);
+	pk.pack(nameserver().getTypeName(t));
+
+	if (v->is_atom())
+	{
+		pk.pack(Sexpr::encode_atom(HandleCast(v)));
+	}
+	else if (FLOAT_VALUE == t or SIMPLE_TRUTH_VALUE == t or
+	         COUNT_TRUTH_VALUE == t)
+	{
+		pk.pack(FloatValueCast(v)->value());
+	}
+	else if (STRING_VALUE == t)
+	{
+		pk.pack(StringValueCast(v)->value());
+	}
+	else if (LINK_VALUE == t)
+	{
+		const std::vector<ValuePtr>& vals = LinkValueCast(v)->value();
+		pk.pack_array(vals.size());
+		for (const ValuePtr& lv : vals)
+			pack_value(pk, lv);
+	}
+	else
+	{
+		pk.pack(Sexpr::encode_value(v));
+	}
+}
+
+static ValuePtr unpack_value(const msgpack::object& obj)
+{
+	if (msgpack::type::ARRAY != obj.type or 2 != obj.via.array.size)
+		throw RuntimeException(TRACE_INFO, "Malformed DHT value");
+
+	Type t = nameserver().getType(obj.via.array.ptr[0].as<std::string>());
+	const msgpack::object& payload = obj.via.array.ptr[1];
+
+	if (msgpack::type::STR == payload.type)
+	{
+		std::string sv = payload.as<std::string>();
+		if (nameserver().isA(t, ATOM))
+			return Sexpr::decode_atom(sv);
+		size_t pos = 0;
+		return Sexpr::decode_value(sv, pos);
+	}
+
+	if (FLOAT_VALUE == t)
+		return createFloatValue(payload.as<std::vector<double>>());
+
+	if (SIMPLE_TRUTH_VALUE == t)
+	{
+		auto fv = payload.as<std::vector<double>>();
+		return SimpleTruthValue::createTV(fv.at(0), fv.at(1));
+	}
+
+	if (COUNT_TRUTH_VALUE == t)
+	{
+		auto fv = payload.as<std::vector<double>>();
+		return CountTruthValue::createTV(fv.at(0), fv.at(1), fv.at(2));
+	}
+
+	if (STRING_VALUE == t)
+		return createStringValue(payload.as<std::vector<std::string>>());
+
+	if (LINK_VALUE == t)
+	{
+		std::vector<ValuePtr> vals;
+		for (uint32_t i = 0; i < payload.via.array.size; i++)
+			vals.emplace_back(unpack_value(payload.via.array.ptr[i]));
+		return createLinkValue(vals);
+	}
+
+	throw RuntimeException(TRACE_INFO, "Unexpected DHT value type %s",
+		nameserver().getTypeName(t).c_str());
+}
+
+/// Encode all of the Values on the Atom into a MessagePack blob. The
+/// `dead` counters are added as tombstones (see DHTCounter.cc).
+dht::Blob DHTAtomStorage::encode_values(const Handle& atom,
+                                        const CounterTombs& dead)
+{
+	msgpack::sbuffer buf;
+	Packer pk(&buf);
+
+	// Values can be changed by other threads while we work.
+	std::vector<std::pair<Handle, ValuePtr>> kvp;
+	for (const Handle& key : atom->getKeys())
+	{
+		ValuePtr v(atom->getValue(key));
+		if (v) kvp.emplace_back(key, v);
+	}
+
+	pk.pack_array(2);
+	pk.pack(VALUES_FORMAT);
+	pk.pack_array(kvp.size() + dead.size());
+	for (const auto& pr : kvp)
+	{
+		bool counter = is_countable(pr.second) and is_counter_key(pr.first);
+		pk.pack_array(counter ? 3 : 2);
+		pk.pack(Sexpr::encode_atom(pr.first));
+		pack_value(pk, pr.second);
+		if (counter)
+			pack_counter(pk, count_local(atom, pr.first, pr.second));
+	}
+	for (const auto& pr : dead)
+	{
+		pk.pack_array(3);
+		pk.pack(Sexpr::encode_atom(pr.first));
+		pk.pack_nil();
+		pack_counter(pk, pr.second);
+	}
+
+	return dht::Blob(buf.data(), buf.data() + buf.size());
+}
+
+/// Decode the blob created by encode_values(), and attach the Values
+/// to the Atom. Older s-expression records are also accepted.
+void DHTAtomStorage::decode_values(Handle& h, const dht::Blob& blob)
+{
+	msgpack::object_handle oh =
+		msgpack::unpack((const char*) blob.data(), blob.size());
+	const msgpack::object& obj = oh.get();
+
+	if (msgpack::type::STR == obj.type)
+	{
+		Sexpr::decode_alist(h, obj.as<std::string>());
+		return;
+	}
+
+	if (msgpack::type::ARRAY != obj.type or 2 != obj.via.array.size or
+	    VALUES_FORMAT != obj.via.array.ptr[0].as<int>())
+		throw RuntimeException(TRACE_INFO, "Unknown DHT value format");
+
+	const msgpack::object& alist = obj.via.array.ptr[1];
+	for (uint32_t i = 0; i < alist.via.array.size; i++)
+	{
+		const msgpack::object& pair = alist.via.array.ptr[i];
+		Handle key(Sexpr::decode_atom(pair.via.array.ptr[0].as<std::string>()));
+
+		// A counter that was removed.
+		if (msgpack::type::NIL == pair.via.array.ptr[1].type)
+		{
+			h->setValue(key, nullptr);
+			continue;
+		}
+		ValuePtr v(unpack_value(pair.via.array.ptr[1]));
+		if (3 == pair.via.array.size)
+			v = count_remote(h, key, v, unpack_counter(pair.via.array.ptr[2]));
+		h->setValue(key, v);
+	}
+}
+
+/// Return true if the blob created by encode_values() holds at least
+/// one Value. The blob left by delete_atom_values() holds none.
+bool DHTAtomStorage::has_values(const dht::Blob& blob)
+{
+	msgpack::object_handle oh =
+		msgpack::unpack((const char*) blob.data(), blob.size());
+	const msgpack::object& obj = oh.get();
+
+	if (msgpack::type::STR == obj.type)
+		return 0 < obj.via.str.size;
+
+	// Counter tombstones are not Values.
+	if (msgpack::type::ARRAY == obj.type and 2 == obj.via.array.size)
+	{
+		const msgpack::object& alist = obj.via.array.ptr[1];
+		for (uint32_t i = 0; i < alist.via.array.size; i++)
+		{
+			const msgpack::object& pair = alist.via.array.ptr[i];
+			if (msgpack::type::NIL != pair.via.array.ptr[1].type)
+				return true;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+/// Print the blob created by encode_values(), for debugging.
+std::string DHTAtomStorage::prt_values(const dht::Blob& blob)
+{
+	msgpack::object_handle oh =
+		msgpack::unpack((const char*) blob.data(), blob.size());
+	std::stringstream ss;
+	ss << oh.get();
+	return ss.str();
+}
+
 /* ================================================================== */
 
 /// Delete ALL of the values associated with the atom.
@@ -62,37 +436,158 @@ void DHTAtomStorage::delete_atom_values(const Handle& atom)
 
 	// Attach the value to the atom
 	dht::InfoHash muid = get_membership(atom);
-	_runner.put(muid, dht::Value(_values_policy, "", 1));
+	put_stuff(muid, dht::Value(_values_policy, "", 1));
+	remote_values_put(atom, false);
 
 	_value_deletes ++;
 }
 
 /* ================================================================ */
 
-Handle DHTAtomStorage::fetch_values(Handle&& h)
+/// Decode the Values that were fetched from the DHT, and attach
+/// them to the Atom.
+void DHTAtomStorage::decode_values(Handle& h,
+                   const std::vector<std::shared_ptr<dht::Value>>& dvals)
 {
-	dht::InfoHash muid = get_membership(h);
-
-	auto dvals = get_stuff(muid, _values_filter);
-
 	// There may be multiple values attached to this Atom.
 	// We only want one; the one with the latest timestamp.
 	unsigned long timestamp = 0;
-	std::string alist;
+	std::shared_ptr<dht::Value> latest;
 	for (const auto& dval : dvals)
 	{
 		// std::cout << "Got value: " << dval->toString() << std::endl;
 		if (timestamp < dval->id)
 		{
 			timestamp = dval->id;
-			alist = dval->unpack<std::string>();
+			latest = dval;
 		}
 	}
-	// std::cout << "Latest svalue: " << alist << std::endl;
-	Sexpr::decode_alist(h, alist);
+	if (latest)
+		decode_values(h, latest->data);
+	else
+		Sexpr::decode_alist(h, "");
+	remote_values_put(h, latest and has_values(latest->data));
 	_value_fetches++;
+}
+
+Handle DHTAtomStorage::fetch_values(Handle&& h)
+{
+	dht::InfoHash muid = read_membership(h);
+
+	// Don't wait on the DHT, if the Atom certainly has no values.
+	// Atoms in the older format are not in the has-values summary.
+	if (not is_legacy(h) and not bloom_may_have(muid))
+	{
+		_value_skips++;
+		decode_values(h, ValueSeq());
+		return h;
+	}
 
+	// The Values may have been changed since they were written to
+	// local disk; that copy is used only if the DHT does not answer.
+	ValueSeq dvals;
+	try
+	{
+		dvals = get_stuff(muid, _values_filter, VALUE_KEYS);
+		disk_put(muid, dvals);
+	}
+	catch (const IOException& ex)
+	{
+		dvals = disk_get(muid, _values_filter);
+		if (dvals.empty()) throw;
+	}
+	decode_values(h, dvals);
 	return h;
 }
 
+/// Same as above, except that it does not wait. The callback `cb`
+/// is called on a dispatcher thread, after the Values have arrived;
+/// or right away, if the Atom certainly has no Values. The has-values
+/// summary is not waited on, either.
+void DHTAtomStorage::fetch_values_async(const Handle& h,
+                              std::function<void(const Handle&)> cb,
+                              InFlight* ifl)
+{
+	dht::InfoHash muid = read_membership(h);
+	auto deliver = [this, h, cb](const ValueSeq& dvals)
+	{
+		Handle hv(h);
+		decode_values(hv, dvals);
+		cb(hv);
+	};
+
+	// As above, the copy on local disk is used only if the DHT does
+	// not answer.
+	auto fetch = [this, muid, deliver](InFlight* ifl)
+	{
+		get_async(muid,
+			[this, muid, deliver](ValueSeq&& dvals)
+			{
+				disk_put(muid, dvals);
+				deliver(dvals);
+			}, _values_filter, ifl,
+			[this, muid, deliver](void)
+			{
+				auto dvals = disk_get(muid, _values_filter);
+				if (dvals.empty())
+					throw IOException(TRACE_INFO, "DHT is not responding!");
+				deliver(dvals);
+			});
+	};
+
+	// Atoms in the older format are not in the has-values summary.
+	if (is_legacy(h))
+	{
+		fetch(ifl);
+		return;
+	}
+
+	// The check of the summary counts as in flight, until the get
+	// for the Values is issued, or the Atom is known to have none.
+	std::shared_ptr<InFlight::Ref> ref;
+	if (ifl)
+	{
+		std::lock_guard<std::mutex> lck(ifl->mtx);
+		ifl->busy++;
+		ref = ifl->ref;
+	}
+	bloom_may_have_async(muid, [this, deliver, fetch, ifl, ref](bool may_have)
+	{
+		if (not inflight_enter(ref)) return;
+
+		std::exception_ptr error;
+		try
+		{
+			if (may_have) fetch(ifl);
+			else
+			{
+				_value_skips++;
+				deliver(ValueSeq());
+			}
+		}
+		catch (...) { error = std::current_exception(); }
+		inflight_done(ref, error, true);
+	});
+}
+
+/* ================================================================ */
+
+/// Fetch the Values for a whole sequence of Atoms, keeping up to
+/// `_load_window` requests in flight at the same time. Each Atom is
+/// handed to `insert` as soon as its Values have arrived; this will
+/// happen on the dispatcher threads, so `insert` must be thread-safe.
+/// Thus, the wall-clock time is that of a few round-trips per window,
+/// instead of one round-trip per Atom.
+void DHTAtomStorage::fetch_values_pipelined(HandleSeq&& hseq,
+                          const std::function<void(const Handle&)>& insert)
+{
+	InFlight ifl;
+	for (const Handle& h : hseq)
+	{
+		inflight_wait(ifl, _load_window - 1);
+		fetch_values_async(h, insert, &ifl);
+	}
+	inflight_drain(ifl);
+}
+
 /* ============================= END OF FILE ================= */
@@ -0,0 +1,155 @@
+/*
+ * DHTWriteBack.cc
+ * Write-behind store queue, with coalescing of repeated stores.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================== */
+//
+// In write-behind mode, storeAtom() does not encode or publish the
+// Atom; it only marks it as being dirty. A writer thread takes the
+// dirty Atoms in the order in which they were first marked, and
+// stores them. If an Atom is stored again, before the writer has
+// gotten to it, then the two stores are coalesced into one: the
+// writer encodes whatever Values are on the Atom at the time that it
+// is written. Thus, an Atom whose counts are bumped thousands of
+// times a second is published only as often as the writer can keep
+// up, instead of being re-serialized on every bump.
+//
+// barrier() waits until everything that was dirty has been written.
+// A store that failed is not tried again; the first such failure is
+// thrown by the next barrier() (or by turning write-behind off).
+//
+// At most MAX_DIRTY_QUEUE Atoms wait to be written; storeAtom() waits
+// for room, after that. Coalesced stores do not take up any room.
+
+#define MAX_DIRTY_QUEUE 65536
+
+/**
+ * Turn write-behind mode on or off. Turning it off flushes the queue,
+ * and stops the writer thread.
+ */
+void DHTAtomStorage::set_write_behind(bool on)
+{
+	if (on and _observing_only)
+		throw IOException(TRACE_INFO, "DHT Node is only observing!");
+
+	if (on == _write_behind) return;
+
+	if (on)
+	{
+		_writer_stop = false;
+		_writer = std::thread(&DHTAtomStorage::write_loop, this);
+		_write_behind = true;
+		return;
+	}
+
+	// The writer writes out everything that is dirty, before it
+	// exits. Stores made after it has been told to stop are done
+	// right away; see write_behind().
+	_write_behind = false;
+	{
+		std::lock_guard<std::mutex> lck(_dirty_mutex);
+		_writer_stop = true;
+	}
+	_dirty_cv.notify_all();
+	_writer.join();
+	write_flush();
+}
+
+/// Mark the Atom as needing to be stored. If write-behind was turned
+/// off meanwhile, the Atom is stored right away, instead.
+void DHTAtomStorage::write_behind(const Handle& h)
+{
+	if (_observing_only)
+		throw IOException(TRACE_INFO, "DHT Node is only observing!");
+
+	std::unique_lock<std::mutex> lck(_dirty_mutex);
+	if (_dirty.end() != _dirty.find(h))
+	{
+		_wb_coalesced++;
+		return;
+	}
+
+	_dirty_cv.wait(lck, [this]
+		{ return _writer_stop or _dirty_order.size() < MAX_DIRTY_QUEUE; });
+	if (_writer_stop)
+	{
+		lck.unlock();
+		store_atom_values(h);
+		store_recursive(h);
+		return;
+	}
+
+	// It may have been queued by someone else, while waiting.
+	if (not _dirty.insert(h).second)
+	{
+		_wb_coalesced++;
+		return;
+	}
+	_dirty_order.push_back(h);
+	_wb_enqueued++;
+	if (_wb_max_depth < _dirty_order.size())
+		_wb_max_depth = _dirty_order.size();
+	_dirty_cv.notify_all();
+}
+
+/// The writer thread.
+void DHTAtomStorage::write_loop(void)
+{
+	std::unique_lock<std::mutex> lck(_dirty_mutex);
+	while (true)
+	{
+		_dirty_cv.wait(lck, [this]
+			{ return _writer_stop or not _dirty_order.empty(); });
+		if (_dirty_order.empty()) return;
+
+		// Once the Atom is off the dirty set, any further stores
+		// of it will queue it again; these are not lost.
+		Handle h(_dirty_order.front());
+		_dirty_order.pop_front();
+		_dirty.erase(h);
+		_writes_busy++;
+		lck.unlock();
+
+		try
+		{
+			store_atom_values(h);
+			store_recursive(h);
+		}
+		catch (const std::exception& ex)
+		{
+			logger().warn("DHT write-behind store failed: %s", ex.what());
+			lck.lock();
+			if (not _write_error) _write_error = std::current_exception();
+			lck.unlock();
+		}
+		_wb_written++;
+
+		lck.lock();
+		_writes_busy--;
+		_dirty_cv.notify_all();
+	}
+}
+
+/// Wait until all of the dirty Atoms have been written. Throws the
+/// first error from a store, since the last flush, if there was one.
+void DHTAtomStorage::write_flush(void)
+{
+	std::unique_lock<std::mutex> lck(_dirty_mutex);
+	_dirty_cv.wait(lck, [this]
+		{ return _dirty_order.empty() and 0 == _writes_busy; });
+
+	std::exception_ptr error;
+	std::swap(error, _write_error);
+	if (error) std::rethrow_exception(error);
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,262 @@
+/*
+ * FILE:
+ * opencog/persist/dht/LRUCache.h
+ *
+ * FUNCTION:
+ * Size-bounded least-recently-used caches.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_DHT_LRU_CACHE_H
+#define _OPENCOG_DHT_LRU_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/**
+ * A map that holds at most `capacity` entries. When full, the entry
+ * that was used least recently is dropped. This class is NOT
+ * thread-safe; the caller must provide locking.
+ */
+template<typename Key, typename Val, typename Hash = std::hash<Key>>
+class LRUCache
+{
+	private:
+		typedef std::list<std::pair<Key, Val>> Entries;
+		Entries _entries; // Most recently used at the front.
+		std::unordered_map<Key, typename Entries::iterator, Hash> _index;
+		size_t _capacity;
+
+	public:
+		size_t hits;
+		size_t misses;
+		size_t evictions;
+
+		LRUCache(size_t capacity) : _capacity(capacity)
+		{
+			clear_stats();
+		}
+
+		/// Look up the key; if found, copy its value into `val`.
+		bool get(const Key& key, Val& val)
+		{
+			auto it = _index.find(key);
+			if (_index.end() == it)
+			{
+				misses++;
+				return false;
+			}
+			hits++;
+			_entries.splice(_entries.begin(), _entries, it->second);
+			val = it->second->second;
+			return true;
+		}
+
+		/// Look up the key; return a pointer to its value, or null if
+		/// it is not there. The pointer is good until the next put().
+		Val* find(const Key& key)
+		{
+			auto it = _index.find(key);
+			if (_index.end() == it)
+			{
+				misses++;
+				return nullptr;
+			}
+			hits++;
+			_entries.splice(_entries.begin(), _entries, it->second);
+			return &it->second->second;
+		}
+
+		/// Return true if the key is in the cache.
+		bool contains(const Key& key)
+		{
+			return nullptr != find(key);
+		}
+
+		/// Insert, or update, the entry for the key.
+		void put(const Key& key, const Val& val)
+		{
+			auto it = _index.find(key);
+			if (_index.end() != it)
+			{
+				it->second->second = val;
+				_entries.splice(_entries.begin(), _entries, it->second);
+				return;
+			}
+
+			_entries.emplace_front(key, val);
+			_index.emplace(key, _entries.begin());
+			shrink();
+		}
+
+		void erase(const Key& key)
+		{
+			auto it = _index.find(key);
+			if (_index.end() == it) return;
+			_entries.erase(it->second);
+			_index.erase(it);
+		}
+
+		void clear(void)
+		{
+			_index.clear();
+			_entries.clear();
+		}
+
+		size_t size(void) const { return _index.size(); }
+		size_t capacity(void) const { return _capacity; }
+
+		void set_capacity(size_t capacity)
+		{
+			_capacity = capacity;
+			shrink();
+		}
+
+		void clear_stats(void)
+		{
+			hits = 0;
+			misses = 0;
+			evictions = 0;
+		}
+
+	private:
+		void shrink(void)
+		{
+			while (_capacity < _index.size())
+			{
+				_index.erase(_entries.back().first);
+				_entries.pop_back();
+				evictions++;
+			}
+		}
+};
+
+/**
+ * A thread-safe LRU cache. The entries are spread over NSTRIPES
+ * independent LRU caches, each with its own lock, and so threads
+ * working on different keys rarely contend with one another. The
+ * least-recently-used order is kept per stripe only; this is close
+ * enough.
+ */
+template<typename Key, typename Val, typename Hash = std::hash<Key>,
+         size_t NSTRIPES = 64>
+class StripedCache
+{
+	private:
+		struct Stripe
+		{
+			std::mutex mtx;
+			LRUCache<Key, Val, Hash> cache;
+			Stripe(size_t capacity) : cache(capacity) {}
+		};
+		std::vector<std::unique_ptr<Stripe>> _stripes;
+		Hash _hash;
+
+		Stripe& stripe(const Key& key)
+		{
+			return *_stripes[_hash(key) % NSTRIPES];
+		}
+
+		static size_t stripe_capacity(size_t capacity)
+		{
+			return (capacity + NSTRIPES - 1) / NSTRIPES;
+		}
+
+		// Sum of some counter over all of the stripes.
+		template<typename Getter>
+		size_t total(Getter get) const
+		{
+			size_t sum = 0;
+			for (const auto& sp : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(sp->mtx);
+				sum += get(sp->cache);
+			}
+			return sum;
+		}
+
+	public:
+		StripedCache(size_t capacity)
+		{
+			for (size_t i = 0; i < NSTRIPES; i++)
+				_stripes.emplace_back(new Stripe(stripe_capacity(capacity)));
+		}
+
+		bool get(const Key& key, Val& val)
+		{
+			Stripe& sp = stripe(key);
+			std::lock_guard<std::mutex> lck(sp.mtx);
+			return sp.cache.get(key, val);
+		}
+
+		bool contains(const Key& key)
+		{
+			Stripe& sp = stripe(key);
+			std::lock_guard<std::mutex> lck(sp.mtx);
+			return sp.cache.contains(key);
+		}
+
+		void put(const Key& key, const Val& val)
+		{
+			Stripe& sp = stripe(key);
+			std::lock_guard<std::mutex> lck(sp.mtx);
+			sp.cache.put(key, val);
+		}
+
+		void erase(const Key& key)
+		{
+			Stripe& sp = stripe(key);
+			std::lock_guard<std::mutex> lck(sp.mtx);
+			sp.cache.erase(key);
+		}
+
+		void set_capacity(size_t capacity)
+		{
+			for (auto& sp : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(sp->mtx);
+				sp->cache.set_capacity(stripe_capacity(capacity));
+			}
+		}
+
+		void clear_stats(void)
+		{
+			for (auto& sp : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(sp->mtx);
+				sp->cache.clear_stats();
+			}
+		}
+
+		typedef LRUCache<Key, Val, Hash> Cache;
+		size_t size(void) const
+			{ return total([](const Cache& c) { return c.size(); }); }
+		size_t capacity(void) const
+			{ return total([](const Cache& c) { return c.capacity(); }); }
+		size_t hits(void) const
+			{ return total([](const Cache& c) { return c.hits; }); }
+		size_t misses(void) const
+			{ return total([](const Cache& c) { return c.misses; }); }
+		size_t evictions(void) const
+			{ return total([](const Cache& c) { return c.evictions; }); }
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_DHT_LRU_CACHE_H
@@ -0,0 +1,318 @@
+/*
+ * seeder.cc
+ * Serve AtomSpace data from a local disk file into the DHT.
+ *
+ * The DHT nodes hold AtomSpace data only in RAM, and only for
+ * DATA_LIFETIME hours. The seeder keeps a copy of the data in a
+ * DHTDiskCache file, and puts all of it back into the DHT, every so
+ * often, before it expires; thus, the DHT never forgets it, even when
+ * the nodes that held it restart. The seeder is itself a DHT node,
+ * with the AtomSpace storage policies; every record that it accepts
+ * for storage is also written to the file, unless the file already
+ * has a newer one. Thus, updates made by the AtomSpace users are kept
+ * too. Records that have been superseded are not put back.
+ *
+ * The seeder does not answer gets from the file: OpenDHT nodes only
+ * answer from what they hold in RAM. A record that expired from the
+ * DHT (for example, because every node holding it restarted) stays
+ * missing until the next republish; use a shorter -r to narrow that
+ * gap.
+ *
+ * Usage:
+ *    dht-seeder [-p port] [-b host:port] [-r hours] FILE
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <opendht.h>
+
+#include "DHTAtomStorage.h"
+#include "DHTDiskCache.h"
+
+using namespace opencog;
+
+#define DEFAULT_SEEDER_PORT 4343
+
+// Number of republishing puts to keep in flight at once.
+#define REPUBLISH_WINDOW 256
+
+static std::atomic<bool> stop(false);
+static void on_signal(int) { stop = true; }
+
+static std::atomic<size_t> accepted(0);
+
+// The records accepted for storage, on their way to the file. The
+// storage policies run on the DHT runner thread; they only queue the
+// records, and the file is written on a thread of its own. A null
+// value stops that thread.
+using Accepted = std::pair<dht::InfoHash, std::shared_ptr<dht::Value>>;
+static concurrent_queue<Accepted> to_disk;
+
+/// The Atom and timestamp of a membership record. Returns false if
+/// the value is not a membership record.
+static bool space_atom(const dht::Value& val,
+                       std::pair<dht::Value::Id, size_t>& atom,
+                       DHTAtomStorage::SpaceRecord& rec)
+{
+	if (DHTAtomStorage::SPACE_ID != val.type) return false;
+	std::string sname;
+	try { sname = val.unpack<std::string>(); }
+	catch (const std::exception& ex) { return false; }
+	if (not DHTAtomStorage::parse_space_record(sname, rec)) return false;
+
+	// The value id is only a 64-bit hash of the Atom.
+	atom = {val.id, std::hash<std::string>()(sname.substr(rec.pos))};
+	return true;
+}
+
+/// Membership records may arrive in any order, and the DHT keeps the
+/// last to arrive. On disk, only a later add or drop of an Atom may
+/// replace an earlier one.
+static bool is_current(DHTDiskCache& disk, const dht::InfoHash& key,
+                       const dht::Value& val)
+{
+	std::pair<dht::Value::Id, size_t> atom, old_atom;
+	DHTAtomStorage::SpaceRecord rec, old_rec;
+	if (not space_atom(val, atom, rec)) return true;
+
+	for (const auto& old : disk.get(key,
+	         [&](const dht::Value& v) { return v.id == val.id; }))
+	{
+		if (space_atom(*old, old_atom, old_rec) and
+		    old_atom == atom and rec.stamp < old_rec.stamp)
+			return false;
+	}
+	return true;
+}
+
+/// Write the accepted records to the file, until told to stop.
+static void disk_loop(DHTDiskCache& disk)
+{
+	while (true)
+	{
+		Accepted acc;
+		to_disk.pop(acc);
+		if (nullptr == acc.second) return;
+		if (is_current(disk, acc.first, *acc.second))
+			disk.put(acc.first, *acc.second);
+	}
+}
+
+/// Wrap the storage policies of the value type, so that whatever
+/// is accepted is also written to disk.
+static dht::ValueType disk_type(dht::ValueType::Id id)
+{
+	dht::ValueType vt = DHTAtomStorage::value_type(id);
+
+	dht::StorePolicy store = vt.storePolicy;
+	vt.storePolicy = [store](dht::InfoHash key,
+	                         std::shared_ptr<dht::Value>& value,
+	                         const dht::InfoHash& from,
+	                         const dht::SockAddr& addr)
+	{
+		if (not store(key, value, from, addr)) return false;
+		to_disk.push({key, std::make_shared<dht::Value>(*value)});
+		accepted++;
+		return true;
+	};
+
+	dht::EditPolicy edit = vt.editPolicy;
+	vt.editPolicy = [edit](dht::InfoHash key,
+	                       const std::shared_ptr<dht::Value>& old_val,
+	                       std::shared_ptr<dht::Value>& new_val,
+	                       const dht::InfoHash& from,
+	                       const dht::SockAddr& addr)
+	{
+		if (not edit(key, old_val, new_val, from, addr)) return false;
+		to_disk.push({key, std::make_shared<dht::Value>(*new_val)});
+		accepted++;
+		return true;
+	};
+	return vt;
+}
+
+/**
+ * Put every current record in the file back into the DHT. Returns the
+ * number of records put, and of those, how many failed, and how many
+ * records were skipped.
+ *
+ * An Atom may have several membership records, under different keys
+ * (the bucket, the type index, and the older unbucketed key). Only the
+ * latest of these, by timestamp, is current; putting back an older
+ * "add" would undo a later "drop". The "drop" itself is put back for
+ * DATA_LIFETIME hours, until every "add" it overrides has expired
+ * from the DHT; after that, it is no longer needed.
+ */
+static void republish(dht::DhtRunner& runner, DHTDiskCache& disk,
+                      size_t& nput, size_t& nfail, size_t& nskip)
+{
+	using Atom = std::pair<dht::Value::Id, size_t>;
+	std::map<Atom, DHTAtomStorage::SpaceRecord> latest;
+	std::vector<dht::InfoHash> keys(disk.keys());
+
+	Atom atom;
+	DHTAtomStorage::SpaceRecord rec;
+	for (const dht::InfoHash& key : keys)
+	{
+		for (const auto& val : disk.get(key))
+		{
+			if (not space_atom(*val, atom, rec)) continue;
+			auto it = latest.find(atom);
+			if (latest.end() == it or it->second.stamp < rec.stamp)
+				latest[atom] = rec;
+		}
+	}
+
+	// Membership records are stamped with seconds since the epoch.
+	using secs = std::chrono::duration<double>;
+	double horizon = std::chrono::duration_cast<secs>(
+		std::chrono::system_clock::now().time_since_epoch()).count()
+		- 3600.0 * DHTAtomStorage::DATA_LIFETIME;
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	size_t busy = 0;
+	std::atomic<size_t> fails(0);
+
+	nput = 0;
+	nskip = 0;
+	for (const dht::InfoHash& key : keys)
+	{
+		for (const auto& val : disk.get(key))
+		{
+			if (stop) break;
+			if (space_atom(*val, atom, rec))
+			{
+				const DHTAtomStorage::SpaceRecord& last = latest[atom];
+				if (rec.stamp < last.stamp or
+				    (not last.add and last.stamp < horizon))
+				{
+					nskip++;
+					continue;
+				}
+			}
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				cv.wait(lck, [&]{ return busy < REPUBLISH_WINDOW; });
+				busy++;
+			}
+			runner.put(key, val,
+				[&](bool ok, const std::vector<std::shared_ptr<dht::Node>>&)
+				{
+					if (not ok) fails++;
+					std::lock_guard<std::mutex> lck(mtx);
+					busy--;
+					cv.notify_all();
+				});
+			nput++;
+		}
+	}
+
+	std::unique_lock<std::mutex> lck(mtx);
+	cv.wait(lck, [&]{ return 0 == busy; });
+	nfail = fails;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-p port] [-b host:port] [-r hours] FILE\n"
+		"Serve the AtomSpace data held in FILE into the DHT.\n"
+		"  -p port       DHT port to listen on (default %d)\n"
+		"  -b host:port  DHT node to bootstrap from\n"
+		"  -r hours      hours between republishing (default %d)\n",
+		prog, DEFAULT_SEEDER_PORT, DHTAtomStorage::DATA_LIFETIME / 2);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	int port = DEFAULT_SEEDER_PORT;
+	std::string boot;
+	int hours = DHTAtomStorage::DATA_LIFETIME / 2;
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "p:b:r:")))
+	{
+		switch (opt)
+		{
+			case 'p': port = atoi(optarg); break;
+			case 'b': boot = optarg; break;
+			case 'r': hours = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc or 0 >= hours) usage(argv[0]);
+
+	DHTDiskCache disk(argv[optind]);
+	printf("dht-seeder: %zu records in %s\n", disk.size(), disk.path().c_str());
+
+	// Same network as the AtomSpace nodes; see DHTAtomStorage::init()
+	dht::DhtRunner::Config config;
+	config.dht_config.node_config.network = 42;
+	config.dht_config.node_config.max_req_per_sec = -1;
+	config.dht_config.node_config.max_peer_req_per_sec = -1;
+	config.threaded = true;
+
+	std::thread writer(disk_loop, std::ref(disk));
+
+	dht::DhtRunner runner;
+	runner.run(port, config);
+
+	// Register the policies. These segfault, if done before the
+	// runner.run() call above.
+	for (dht::ValueType::Id id = DHTAtomStorage::ATOM_ID;
+	     id <= DHTAtomStorage::SNAPSHOT_ID; id++)
+		runner.registerType(disk_type(id));
+
+	if (not boot.empty())
+	{
+		size_t colon = boot.find(':');
+		if (std::string::npos == colon)
+			runner.bootstrap(boot, std::to_string(DEFAULT_SEEDER_PORT));
+		else
+			runner.bootstrap(boot.substr(0, colon), boot.substr(colon+1));
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	printf("dht-seeder: running on port %d, republishing every %d hours\n",
+	       port, hours);
+
+	while (not stop)
+	{
+		auto start = std::chrono::steady_clock::now();
+		size_t nput, nfail, nskip;
+		republish(runner, disk, nput, nfail, nskip);
+		disk.flush();
+		printf("dht-seeder: republished %zu records (%zu failed), "
+		       "skipped %zu superseded, accepted %zu updates\n",
+		       nput, nfail, nskip, (size_t) accepted);
+
+		auto next = start + std::chrono::hours(hours);
+		while (not stop and std::chrono::steady_clock::now() < next)
+			sleep(1);
+	}
+
+	printf("dht-seeder: shutting down\n");
+	runner.join();
+	to_disk.push({dht::InfoHash(), nullptr});
+	writer.join();
+	disk.flush();
+	return 0;
+}
@@ -14,7 +14,12 @@
 (export dht-bootstrap dht-clear-stats dht-close dht-open dht-stats
 	dht-examine dht-atomspace-hash dht-immutable-hash dht-atom-hash
 	dht-node-info dht-storage-log dht-routing-tables-log dht-searches-log
-	dht-load-atomspace)
+	dht-load-atomspace dht-open-disk-cache
+	dht-export-snapshot dht-import-snapshot
+	dht-publish-snapshot dht-fetch-snapshot
+	dht-listen-atomspace dht-listen-values dht-refresh-atomspace
+	dht-counter-key dht-set-load-window dht-set-cache-capacity
+	dht-set-write-behind)
 
 ; --------------------------------------------------------------
 
@@ -35,6 +40,9 @@
  dht-atomspace-hash - Return string holding the AtomSpace DHT hash-key.
     The returned string will be a 40-character hex string encoding the
     20-byte hash-key of the DHT entry for the currently open AtomSpace.
+    The Atoms in the AtomSpace are scattered over many bucket keys,
+    derived from the AtomSpace name; passing this hash to `dht-examine`
+    will print the contents of all of these buckets.
 
     Example: Print all of the Atoms in the AtomSpace
        (display (dht-examine (dht-atomspace-hash)))
@@ -70,6 +78,163 @@
     no longer be stored to or fetched from the database.
 ")
 
+(set-procedure-property! dht-open-disk-cache 'documentation
+"
+ dht-open-disk-cache PATH - Keep a local copy of DHT records in a file.
+    All Atoms and Values that are stored, or fetched from the DHT, are
+    also written to the file at PATH. Atoms are looked for there first,
+    before asking the DHT. Values may have been changed by others, and
+    so they are always asked for; the copy in the file is used only if
+    the DHT does not answer. Thus, after a restart, data that was seen
+    before is loaded from local disk, even if the DHT nodes that held
+    it are gone. The file is created if it does not exist. Call this
+    right after `dht-open`.
+
+    Example:
+       (dht-open \"dht:///test-atomspace\")
+       (dht-open-disk-cache \"/tmp/test-atomspace.dhtc\")
+")
+
+(set-procedure-property! dht-export-snapshot 'documentation
+"
+ dht-export-snapshot PATH - Write the AtomSpace to a snapshot file.
+    All of the Atoms in the AtomSpace, together with their Values, are
+    written to the file at PATH, in a compact binary format. Loading
+    the file with `dht-import-snapshot` is much faster than fetching
+    the Atoms one at a time from the DHT.
+
+    Example:
+       (dht-export-snapshot \"/tmp/test-atomspace.snap\")
+")
+
+(set-procedure-property! dht-import-snapshot 'documentation
+"
+ dht-import-snapshot PATH - Load the snapshot file into the AtomSpace.
+    All of the Atoms and Values in the snapshot file at PATH are added
+    to the AtomSpace. Nothing is fetched from the DHT.
+
+    Example:
+       (dht-import-snapshot \"/tmp/test-atomspace.snap\")
+")
+
+(set-procedure-property! dht-publish-snapshot 'documentation
+"
+ dht-publish-snapshot PATH - Put the snapshot file into the DHT.
+    The snapshot file at PATH is stored in the DHT in large chunks,
+    and announced as the latest snapshot of the open AtomSpace. The
+    returned string is the 40-character hex hash of the file. Other
+    peers can then get the whole AtomSpace with `dht-fetch-snapshot`.
+
+    Example:
+       (dht-export-snapshot \"/tmp/test-atomspace.snap\")
+       (dht-publish-snapshot \"/tmp/test-atomspace.snap\")
+")
+
+(set-procedure-property! dht-fetch-snapshot 'documentation
+"
+ dht-fetch-snapshot PATH - Get the latest snapshot from the DHT.
+    The latest snapshot published for the open AtomSpace is fetched,
+    checked against its hash, and written to the file at PATH. The
+    returned string is the hash of the snapshot. Use
+    `dht-import-snapshot` to load it.
+
+    Example:
+       (dht-fetch-snapshot \"/tmp/test-atomspace.snap\")
+       (dht-import-snapshot \"/tmp/test-atomspace.snap\")
+")
+
+(set-procedure-property! dht-listen-atomspace 'documentation
+"
+ dht-listen-atomspace - Follow changes made to the AtomSpace by others.
+    From now on, whenever another DHT node adds an Atom to the open
+    AtomSpace, it is also added to this AtomSpace, together with its
+    Values; whenever another node deletes an Atom, it is also removed
+    from this AtomSpace. The first thing that arrives is everything
+    that is already in the AtomSpace. Following stops when the
+    AtomSpace is closed.
+
+    Example:
+       (dht-open \"dht:///test-atomspace\")
+       (dht-listen-atomspace)
+")
+
+(set-procedure-property! dht-listen-values 'documentation
+"
+ dht-listen-values ATOM - Follow changes made to the Values on ATOM.
+    From now on, whenever another DHT node changes the Values on ATOM,
+    the new Values are also placed on ATOM in this AtomSpace. ATOM is
+    added to this AtomSpace, if it is not there already. Calling this
+    again for the same ATOM does nothing. Following stops when the
+    AtomSpace is closed.
+
+    Example:
+       (dht-listen-values (Concept \"foo\"))
+       ; ... some time later ...
+       (cog-keys->alist (Concept \"foo\"))
+")
+
+(set-procedure-property! dht-counter-key 'documentation
+"
+ dht-counter-key KEY - Keep the Values under KEY as shared counters.
+    Normally, when two processes store Values on the same Atom, the
+    last one wins. For a counter key, the CountTruthValues (their
+    count) and the FloatValues (every entry) are instead added up:
+    the increments made by all processes are kept, without any of
+    them having to fetch the Atom first. Every process that stores
+    counts must declare the key; processes that only fetch them
+    need not. Each process adds the change of its local count, since
+    it was last stored or fetched. What it has added is kept in the
+    directory ~/.atomspace-dht, so that it is not lost on restart.
+
+    Example:
+       (define cnt (Predicate \"count\"))
+       (dht-counter-key cnt)
+       (cog-set-value! (Concept \"foo\") cnt (FloatValue 1 2 3))
+       (store-atom (Concept \"foo\"))
+")
+
+(set-procedure-property! dht-set-load-window 'documentation
+"
+ dht-set-load-window N - Keep up to N fetches in flight at once.
+    When loading many Atoms, as `dht-load-atomspace` and `load-type`
+    do, the Values of the Atoms are fetched N at a time, without
+    waiting for each fetch to finish before starting the next. Larger
+    windows load faster over slow networks, but put more load on the
+    DHT nodes. The default is 256.
+
+    Example:
+       (dht-set-load-window 256)
+       (dht-load-atomspace \"test-atomspace\")
+")
+
+(set-procedure-property! dht-set-cache-capacity 'documentation
+"
+ dht-set-cache-capacity N - Keep at most N entries in each local cache.
+    The DHT keys and the decoded records of recently used Atoms are
+    kept in memory, so that they need not be worked out or fetched
+    again. Each of these caches holds at most N entries; the least
+    recently used are dropped first. The default is 1048576.
+
+    Example:
+       (dht-set-cache-capacity 100000)
+")
+
+(set-procedure-property! dht-set-write-behind 'documentation
+"
+ dht-set-write-behind BOOL - Turn write-behind mode on or off.
+    In write-behind mode, `store-atom` only marks the Atom as needing
+    to be stored; a background thread stores it a bit later. An Atom
+    that is stored many times, before the background thread gets to
+    it, is stored only once, with the Values it has at that time.
+    `barrier` waits until everything marked has been stored. Turning
+    the mode off stores everything that is still marked.
+
+    Example:
+       (dht-set-write-behind #t)
+       (for-each store-atom (cog-get-atoms 'ConceptNode))
+       (barrier)
+")
+
 (set-procedure-property! dht-examine 'documentation
 "
  dht-examine HASH-KEY - Return string describing a DHT entry.
@@ -88,8 +253,10 @@
  dht-immutable-hash ATOM - Return string w/DHT hash-key encoding of ATOM.
     The returned string will be a 40-character hex string encoding the
     20-byte hash-key of the DHT entry for the ATOM in its immutable
-    form: that is, the scheme string representation of the Atom, as
-    it is without any attached Values or IncomingSet. This entry
+    form: that is, the Atom as it is, without any attached Values or
+    IncomingSet. The hash is computed from the Atom type and the Atom
+    name (for Nodes) or the hashes of the outgoing set (for Links).
+    This entry
     exists outside of any particular AtomSpace, as it is globally unique
     (precisely because it has no attached Values or IncomingSet.)
     As such, it can be used as the globally-unique handle for the ATOM.
@@ -161,3 +328,20 @@
 
    See also `dht-fetch-atom` for loading individual atoms.
 ")
+
+(set-procedure-property! dht-refresh-atomspace 'documentation
+"
+ dht-refresh-atomspace NAME - Load only the changes made to NAME since
+   the last load or refresh of it. Atoms that were added since then are
+   loaded, together with their Values; Atoms that were deleted since
+   then are removed from the AtomSpace. The first refresh of an
+   AtomSpace loads all of it, just like `dht-load-atomspace`.
+
+   This is much cheaper than loading a large AtomSpace again, and is
+   meant to be called periodically.
+
+   Example:
+      (dht-load-atomspace \"test-atomspace\")
+      ; ... some time later ...
+      (dht-refresh-atomspace \"test-atomspace\")
+")